@@ -18,34 +18,78 @@
 #include "nv_utils.h"
 #include "epoch_common.h"
 
-#define APT_POOL_SIZE    (10 * 1024 * 1024) /* 1 MB */
+/*
+	the tables of all the threads are allocated from a single pool, opened on first use (and created if its file does not exist)
+*/
+#define APT_POOL_SIZE    (64 * 1024 * 1024) /* 64 MB */
+#define APT_POOL_DIR "/tmp"
+#define APT_POOL_FILE "apt_pool"
 
 
 #define LAYOUT_NAME "apt"
 
 #define DEFAULT_PAGE_BUFFER_SIZE 128
 #define CLEAN_THRESHOLD 64
+#define CLEAN_STEP 16 //positions cleaned by each mark_page while a clean up pass is in progress
 
 //#define WORDS_PER_CACHE_LINE 8
-#define PAGE_SIZE 4096 //could have larger granularity pages as well - that would reduce the number of page numbers we need to store
+#define PAGE_SIZE 4096 //default granularity; larger pages (e.g., 2 MB for heaps on huge pages) mean fewer entries to store and persist, but larger regions to scan on recovery
 
-
-//#define DO_STATS 1
 /*
 	the page buffer is NOT thread safe;
 	we assume such a buffer for each individual thread
 */
 
-#define MAX_NUM_PAGES 8192
+/*
+	only the pages are persistent, 8 per cache line, in a chain of segments: the first one is part of the table,
+	the others are allocated from the pool when the table grows, and freed when they are empty again;
+	the timestamps only drive the clean up, they are kept in a parallel volatile array and start at 0 when a table is reopened
+*/
+#define SEGMENT_PAGES 1024 //a multiple of 64
+
+typedef struct page_segment_t {
+	PMEMoid next; //the next segment of the table, OID_NULL for the last one
+	void* pages[SEGMENT_PAGES]; //start address of the page at each position, NULL if empty
+} page_segment_t;
 
-typedef struct page_descriptor_t {
-	void* page;
+typedef struct page_times_t {
 	EpochTsVal lastTsAccess;
 	EpochTsVal lastTsIns;
-}page_descriptor_t;
+} page_times_t;
+
+/*
+	volatile index over the persistent pages, rebuilt whenever a table is opened:
+	the segments of the chain, the timestamps, an open addressing (linear probing) hash table from page address to position,
+	a two level bitmap of the empty positions below last_in_use, and the state of the incremental clean up
+*/
+
+//the last few pages marked, most recent first, checked before anything else
+#define PAGE_MRU_SIZE 4
+
+typedef struct page_mru_entry_t {
+	void* page;
+	size_t position;
+} page_mru_entry_t;
+
+typedef struct page_index_t {
+	UINT32 page_shift; //log2 of the page size of the table
+	page_mru_entry_t mru[PAGE_MRU_SIZE];
+	size_t num_segments;
+	page_segment_t** segments;
+	page_times_t* times; //one per position of the segments
+	PMEMoid oid; //the allocation of the table, which starts at the first cache line boundary in it
+	UINT32 slots_bits; //log2 of the number of slots, which is at least twice the positions of the segments
+	UINT32* slots; //1 + the position of a page hashing here; 0 if empty
+	UINT64* free_bits; //one bit per position of the segments
+	UINT64* free_summary; //which words of free_bits are not 0
+	size_t clean_cursor; //next position to clean; SIZE_MAX if no clean up pass is in progress
+	EpochTsVal clean_ts;
+	EpochTsVal clean_curr_ts;
+} page_index_t;
 
 typedef struct active_page_table_t {
-	size_t page_size; //TODO what if I want to add a larger page?
+	UINT32 thread_id;
+	size_t page_size; //granularity of the table: a power of two, at least PAGE_SIZE
 	size_t current_size;
     size_t last_in_use;
 	EpochTsVal last_cleared;
@@ -53,33 +97,73 @@ typedef struct active_page_table_t {
 #ifdef BUFFERING_ON
 	linkcache_t* shared_flush_buffer;
 #endif
-#ifdef DO_STATS
-	UINT64 num_marks;
-	UINT64 hits;
-#endif
-	page_descriptor_t pages[MAX_NUM_PAGES]; // pages from which frees and allocs just happened
+	page_index_t* index; //volatile
+	page_segment_t first_segment; // pages from which frees and allocs just happened
 } active_page_table_t;
 
 
 POBJ_LAYOUT_BEGIN(apt);
-POBJ_LAYOUT_ROOT(apt, active_page_table_t);
+POBJ_LAYOUT_TOID(apt, active_page_table_t);
+POBJ_LAYOUT_TOID(apt, page_segment_t);
 POBJ_LAYOUT_END(apt);
 
+//persistent entry at a position of the table
+inline void** page_entry(active_page_table_t* table, size_t position) {
+	return &table->index->segments[position / SEGMENT_PAGES]->pages[position % SEGMENT_PAGES];
+}
+
+//timestamps of the page at a position of the table
+inline page_times_t* page_times(active_page_table_t* table, size_t position) {
+	return &table->index->times[position];
+}
+
 //given an address, get the start memory location of the page it belongs to
-inline void* get_page_start_address(void* address) {
-	return (void*) ((UINT_PTR)address & ~(PAGE_SIZE - 1));
+inline void* get_page_start_address(active_page_table_t* table, void* address) {
+	return (void*) ((UINT_PTR)address & ~(table->page_size - 1));
 }
 
+//set the directory (APT_POOL_DIR, or NV_APT_DIR if set) and the size in bytes (APT_POOL_SIZE, or NV_APT_POOL_MB megabytes if set) of the pool;
+//only has an effect before the first table is created
+void active_page_pool_configure(const char* dir, size_t size);
+
+//close the pool, once the tables of all the threads have been destroyed; the file is kept
+//for a later recovery unless remove_file is set
+void active_page_pool_close(int remove_file);
+
+/*
+	recovery: the pool of a previous run is opened before any table is created,
+	its pages are enumerated, then its tables are freed and the pool is reused by the new tables;
+	tables created without a recovery are added next to the ones of the previous run, which then accumulate
+*/
+
+//called for each page marked in a table of the previous run
+typedef void (*active_page_fun)(void* page, size_t page_size, UINT32 thread_id, void* context);
+
+//open the pool left by a previous run; returns the number of tables in it, -1 if there is no such pool
+int active_page_pool_open();
+
+//call fun for each page marked in the tables of the pool; returns the number of pages
+size_t active_page_pool_for_each_page(active_page_fun fun, void* context);
+
+//free the tables of the pool
+void active_page_pool_free_tables();
+
 //allocate a oage buffer already containing space for a predefined number of elements
 active_page_table_t* create_active_page_table(UINT32 id);
 
+//same, with pages of page_size bytes (rounded up to a power of two, at least PAGE_SIZE)
+active_page_table_t* create_active_page_table_with_page_size(UINT32 id, size_t page_size);
+
 //deallocate the bage buffer and entries
 void destroy_active_page_table(active_page_table_t* to_delete);
 
+//deallocate the volatile index only; the table stays in the pool, for a recovery
+void forget_active_page_table(active_page_table_t* to_forget);
+
 //if a page is not present, add it to the buffer and persist the addition
 void mark_page(active_page_table_t* pages, void* ptr, int allocation_size, EpochTsVal currentTs, EpochTsVal collectTs, int isRemove);
 
-//clear all the pages in the buffer
+//clear all the pages in the buffer, in one pass (mark_page cleans CLEAN_STEP positions at a time instead)
 void clear_buffer(active_page_table_t* buffer, EpochTsVal cleanTs, EpochTsVal currTs);
 
 #endif
@@ -8,6 +8,7 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <stddef.h>
+#include <time.h>
 #include <libpmem.h>
 #include <libpmemobj.h>
 
@@ -32,7 +33,10 @@ void EpochGlobalShutdown();
 // print all stats
 void EpochPrintStats();
 
-// initialize and cleanup epoch-related thread data
+// initialize and cleanup epoch-related thread data; returns NULL if the
+// thread's active page table cannot be allocated (the pool cannot be
+// opened, or is full). The tables of a previous run stay in the pool
+// until EpochRecover frees them, so recover before initializing threads.
 EpochThread EpochThreadInit(UINT32 id);
 void EpochThreadShutdown(EpochThread epoch);
 
@@ -42,6 +46,35 @@ void EpochSetFlushBuffer(linkcache_t* buffer_ptr);
 
 void EpochGlobalInit(linkcache_t* buffer_ptr);
 
+// granularity of the active page tables of the threads initialized
+// afterwards (PAGE_SIZE by default)
+void EpochSetPageSize(size_t page_size);
+
+// post-crash recovery: tells whether a node allocated before the crash
+// is reachable from the data structure
+typedef int (*EpochReachableFun)(void *node, void *context);
+
+struct EpochRecoveryStats {
+	UINT64 tables;
+	UINT64 pages;
+	UINT64 liveNodes;
+	UINT64 freedNodes;
+	UINT64 workers;
+	UINT64 timeUs;
+};
+
+// scan the pages marked in the active page tables of the previous run for
+// allocated nodes of nodeSize bytes, and free the unreachable ones; nodes
+// are assumed to start at multiples of nodeSize within a page.
+// The pages are scanned by several threads, so reachable has to be
+// thread safe. Call after EpochGlobalInit and before any thread is
+// initialized. Returns -1 if there is nothing to recover.
+int EpochRecover(size_t nodeSize, EpochReachableFun reachable, void *context,
+		EpochRecoveryStats *stats);
+
+// number of threads used by EpochRecover (one per online cpu by default)
+void EpochSetRecoveryThreads(UINT32 numThreads);
+
 // start and end epochs
 void EpochStart(EpochThread epoch);
 void EpochEnd(EpochThread epoch);
@@ -77,7 +110,9 @@ void EpochScan(EpochThread opaqueEpoch);
 //
 
 
-static linkcache_t* link_flush_buffer;
+// defined in epoch.cpp
+extern linkcache_t* link_flush_buffer;
+extern size_t active_page_size;
 
 // one pointer to deallocate
 struct EpochNode
@@ -145,7 +180,9 @@ struct EpochGeneration
 struct EpochThreadData
 {
 	// Init / Uninit.
-	void Init(UINT32 id);
+	// Init returns false if the active page table cannot be allocated;
+	// Uninit still has to be called then.
+	bool Init(UINT32 id);
 	void Uninit();
 
 	// Free all data that this thread deallocated.
@@ -169,6 +206,10 @@ struct EpochThreadData
 
 	active_page_table_t* active_page_table;
 
+	// Link cache buckets this thread linked into since its last
+	// generation change. Thread local.
+	touched_buckets_t touched_buckets;
+
 	// For chaining all epochs.
 	// Read shared by other threads during normal execution.
 	// Write shared during initialization.
@@ -278,7 +319,7 @@ inline void EpochGeneration::Clean() {
 // EpochThreadData.
 //
 
-inline void EpochThreadData::Init(UINT32 id) {
+inline bool EpochThreadData::Init(UINT32 id) {
 	// initialize this thread's epoch appropriately
 	ts = EPOCH_FIRST_EPOCH;
 
@@ -321,10 +362,17 @@ inline void EpochThreadData::Init(UINT32 id) {
 	stats.Init();
 
 	//init the page buffer
-	active_page_table = create_active_page_table(id);
+	active_page_table = create_active_page_table_with_page_size(id, active_page_size);
+	touched_buckets.num_buckets = 0;
+	touched_buckets.overflow = 0;
+	if (active_page_table == NULL) {
+		return false;
+	}
 #ifdef BUFFERING_ON
 	active_page_table->shared_flush_buffer = link_flush_buffer;
+	cache_track_touched_buckets(&touched_buckets);
 #endif
+	return true;
 }
 
 inline void EpochThreadData::Uninit() {
@@ -342,9 +390,14 @@ inline void EpochThreadData::Uninit() {
 
 	// uninit the used vector buffer
 	vectorTsBuf.Uninit();
-//#ifndef ESTIMATE_RECOVERY
-	destroy_active_page_table(active_page_table);
-//#endif
+#ifdef BUFFERING_ON
+	cache_track_touched_buckets(NULL);
+#endif
+#ifndef ESTIMATE_RECOVERY
+	if (active_page_table != NULL) {
+		destroy_active_page_table(active_page_table);
+	}
+#endif
 }
 
 // This is not thread safe and is used during shutdown.
@@ -415,7 +468,7 @@ inline void EpochReclaimObject(
 	node->tls = tls;
 	node->finalizeFun = finalizeFun;
 #ifdef SIMULATE_NAIVE_IMPLEMENTATION
-	write_data_wait(ptr, 1);
+	write_data_wait_at(ptr, 1, NV_SITE_EPOCH);
 #endif
 	usedNodes++;
 	//fprintf(stderr, "used nodes is %u\n", usedNodes);
@@ -432,17 +485,20 @@ inline void EpochReclaimObject(
 inline void* EpochAllocNode(EpochThread opaqueEpoch, size_t size) {
 	EpochThreadData *epoch = (EpochThreadData *)opaqueEpoch;
 #ifdef SIMULATE_NAIVE_IMPLEMENTATION
-	write_data_wait(NULL, 1);
+	// persist the allocation itself instead of marking its page
+	void *node = AllocNode(size);
+	write_data_wait_at(node, 1, NV_SITE_EPOCH);
+	return node;
 #else
 	mark_page(epoch->active_page_table, NULL, size, epoch->ts, epoch->largestCollectedTs, 0);
-#endif
 	return AllocNode(size);
+#endif
 }
 
 inline void EpochDeclareUnlinkNode(EpochThread opaqueEpoch, void * ptr, size_t size) {
 	EpochThreadData *epoch = (EpochThreadData *)opaqueEpoch;
 #ifdef SIMULATE_NAIVE_IMPLEMENTATION
-	write_data_wait(ptr, 1);
+	write_data_wait_at(ptr, 1, NV_SITE_EPOCH);
 #else
 	mark_page(epoch->active_page_table, ptr, size, epoch->ts, epoch->largestCollectedTs, 1);
 #endif
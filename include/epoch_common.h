@@ -49,4 +49,11 @@ const ULONG EPOCH_INITIAL_EPOCH_VECTOR_SIZE = 16;
 const UINT64 EPOCH_FIRST_EPOCH = 0;
 const UINT64 EPOCH_LAST_EPOCH = 0xffffffffffffffff;
 
+// Pages a recovery thread claims at a time, from its own partition or
+// from the partition of another thread once its own is done.
+const ULONG EPOCH_RECOVERY_CLAIM = 16;
+
+// Unreachable nodes a recovery thread gathers before freeing them.
+const ULONG EPOCH_RECOVERY_FREE_BATCH = 256;
+
 #endif
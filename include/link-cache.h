@@ -2,6 +2,7 @@
 #define _LINK_CACHE_H_
 
 #include <malloc.h>
+#include <pthread.h>
 #include <immintrin.h>
 
 #include "nv_utils.h"
@@ -11,31 +12,91 @@
 volatile memory which stores the cache lines that need to be persistenly
 written to non-volatile memory*/
 
-#define NUM_BUCKETS 32
+#define DEFAULT_NUM_BUCKETS 32
+#define MAX_NUM_BUCKETS ((UINT32)1 << 31) //largest power of two a UINT32 holds
 #define KEY_TO_HASH_MOD 65536
-#define NUM_ENTRIES_PER_BUCKET 6
+#define NUM_ENTRIES_PER_BUCKET 16
+
+//extra buckets, after the regular ones, which hold the links that do not fit in their (full) bucket until the next write-back:
+//one per STASH_BUCKET_RATIO regular buckets, at least MIN_NUM_STASH_BUCKETS
+#define STASH_BUCKET_RATIO 64
+#define MIN_NUM_STASH_BUCKETS 4
 
 typedef union header_t {
 	struct {
-		volatile UINT16 write_back_lock;
-		volatile UINT16 local_flags;
+		volatile UINT32 write_back_lock;
+		volatile UINT32 local_flags; //2 bits per entry
 	};
-	volatile UINT32 all;
+	volatile UINT64 all;
 }header_t;
 
+//the header and the hashes share the first cache line, so a lookup which does not match only touches that line
 typedef CACHE_ALIGNED struct bucket_t {
 	volatile header_t header;
-	volatile UINT16 hashes[6];
-	volatile void* addresses[6];
+	volatile UINT16 hashes[NUM_ENTRIES_PER_BUCKET];
+	volatile UINT32 flush_seq; //number of completed write-backs; only changed while holding write_back_lock
+	volatile void* addresses[NUM_ENTRIES_PER_BUCKET] CACHE_ALIGNED;
 } bucket_t;
 
+/*
+	optional background flusher: a thread which periodically writes back the buckets
+	that have at least high_watermark entries in use, so that inserts rarely find a full bucket
+*/
+#define DEFAULT_FLUSHER_HIGH_WATERMARK ((NUM_ENTRIES_PER_BUCKET * 3) / 4)
+#define DEFAULT_FLUSHER_PERIOD_US 50
+#define DEFAULT_FLUSHER_DUTY_CYCLE 50
+
+typedef struct flusher_config_t {
+	UINT32 high_watermark; //entries in use (pending or busy) above which a bucket is written back
+	int cpu; //core the flusher is pinned to; -1 for no pinning
+	UINT32 period_us; //minimum pause between two passes over the buckets
+	UINT32 duty_cycle; //maximum percentage of the time the flusher spends working
+} flusher_config_t;
+
+/*
+	backoff of the CAS loops on the bucket headers: after each failed CAS, pause for the current number of _mm_pause,
+	which starts at min_pause and doubles up to max_pause; the failed CASes are counted in the thread's cache_cas_failures
+*/
+#define DEFAULT_BACKOFF_MIN_PAUSE 1
+#define DEFAULT_BACKOFF_MAX_PAUSE 64
+
+typedef struct backoff_config_t {
+	UINT32 min_pause;
+	UINT32 max_pause;
+} backoff_config_t;
+
+/*
+	summary of the buckets which (may) have busy entries, or entries whose write-back has not completed yet, one bit per bucket;
+	each shard sits in its own cache line, so that marking buckets dirty in different shards does not conflict
+*/
+#define BUCKETS_PER_DIRTY_SHARD 64
+
+typedef CACHE_ALIGNED struct dirty_shard_t {
+	volatile UINT64 buckets;
+} dirty_shard_t;
+
 typedef CACHE_ALIGNED struct linkcache_t {
-	bucket_t* buckets[NUM_BUCKETS];
+	bucket_t* buckets; //num_buckets + num_stash_buckets contiguous buckets
+	dirty_shard_t* dirty;
+	UINT32 num_dirty_shards;
+	UINT32 num_buckets; //a power of two
+	UINT32 bucket_mask;
+	UINT32 bucket_shift; //log2(num_buckets)
+	UINT32 num_stash_buckets; //a power of two
+	volatile int flusher_running;
+	pthread_t flusher;
+	flusher_config_t flusher_config;
+	backoff_config_t backoff;
 } linkcache_t;
 
 
-//create a new cache
-linkcache_t* cache_create();
+//create a new cache with num_buckets buckets (rounded up to a power of two, at most MAX_NUM_BUCKETS; DEFAULT_NUM_BUCKETS if 0)
+linkcache_t* cache_create(UINT32 num_buckets);
+
+void cache_backoff_default_config(backoff_config_t* config);
+
+//same as cache_create, with the given backoff of the CAS loops (the default one if NULL)
+linkcache_t* cache_create_with_backoff(UINT32 num_buckets, const backoff_config_t* backoff);
 
 //free a cache
 void cache_destroy(linkcache_t* cache);
@@ -48,14 +109,55 @@ void cache_destroy(linkcache_t* cache);
 //or if a search finds the key
 int bucket_wb(linkcache_t* cache, int bucket_num);
 
+//waits for (or does) a write-back of the bucket that started after its flush_seq was read as seq
+void bucket_wb_after(linkcache_t* cache, UINT32 bucket_num, UINT32 seq);
+
+#define TOUCHED_BUCKETS_MAX 64
+
+//the buckets one thread linked into since they were last written back by cache_wb_touched_buckets
+typedef struct touched_buckets_t {
+	UINT32 num_buckets;
+	UINT32 overflow; //more than TOUCHED_BUCKETS_MAX buckets were touched
+	UINT32 buckets[TOUCHED_BUCKETS_MAX];
+	UINT32 seqs[TOUCHED_BUCKETS_MAX]; //flush_seq of each bucket, read after the last link into it
+} touched_buckets_t;
+
+//record the buckets the calling thread links into in touched (NULL stops the tracking)
+void cache_track_touched_buckets(touched_buckets_t* touched);
+
+//make sure the links recorded in touched are persisted, then reset it
+void cache_wb_touched_buckets(linkcache_t* cache, touched_buckets_t* touched);
+
+//make sure the link of key is persistent; returns 1 if a write-back of its bucket was done or waited for, 0 if there was nothing to flush
 int cache_scan(linkcache_t* cache, UINT64 key);
 
+/*
+	reads the value linked in slot (whose key is the one passed to cache_try_link_and_add) and makes sure it is persistent;
+	the value is returned unmarked, and is only written back if it is not persistent yet
+*/
+void* cache_read_persisted(linkcache_t* cache, UINT64 key, volatile void** slot);
+
 int cache_try_link_and_add(linkcache_t* cache, UINT64 key, volatile void** target, volatile void* oldvalue, volatile void* value);
 
+//maximum number of targets linked together by one cache_try_link_and_add_n; the others are linked one at a time
+#define LINK_BATCH_MAX 32
+
+//links targets[i] from oldvalues[i] to values[i], in order, stopping at the first that fails; returns the number of targets linked
+int cache_try_link_and_add_n(linkcache_t* cache, int n, UINT64 keys[], volatile void** targets[], volatile void* oldvalues[], volatile void* values[]);
+
 void cache_wb_all_buckets(linkcache_t* cache);
 
 int cache_size(linkcache_t* cache); //not thread-safe!
 
+//fills config with the defaults
+void cache_flusher_default_config(flusher_config_t* config);
+
+//starts the background flusher (with the default config if config is NULL); returns 0 on success
+int cache_start_flusher(linkcache_t* cache, const flusher_config_t* config);
+
+//stops the background flusher, if running; also done by cache_destroy
+void cache_stop_flusher(linkcache_t* cache);
+
 //00 - free
 //01 - pending
 //10 - busy
@@ -64,68 +166,122 @@ int cache_size(linkcache_t* cache); //not thread-safe!
 #define STATE_PENDING 0x1
 #define STATE_BUSY 0x2
 
-static inline UINT32 mark_pending(UINT16 bmap, int pos) {
+//masks selecting the low / high bit of every entry
+#define STATE_LOW_BITS 0x55555555
+#define STATE_HIGH_BITS 0xaaaaaaaa
+
+static inline UINT32 mark_pending(UINT32 bmap, int pos) {
 	return (bmap & ~(0x00000003 << (2 * pos))) | (0x1 << (2 * pos));
 }
 
-static inline UINT32 mark_busy(UINT16 bmap, int pos) {
+static inline UINT32 mark_busy(UINT32 bmap, int pos) {
 	return (bmap & ~(0x00000003 << (2 * pos))) | (0x2 << (2 * pos));
 }
 
-static inline UINT32 mark_free(UINT16 bmap, int pos) {
+static inline UINT32 mark_free(UINT32 bmap, int pos) {
 	return bmap & ~(0x00000003 << (2*pos));
 }
 
-static inline int is_free(UINT16 bmap, int pos) {
+static inline int is_free(UINT32 bmap, int pos) {
 	return (bmap & (0x03 << (2 * pos))) == 0;
 }
 
-static inline int is_pending(UINT16 bmap, int pos) {
-	return (bmap & (0x03 << (2 * pos))) == 1;
+static inline int is_pending(UINT32 bmap, int pos) {
+	return (bmap & (0x03 << (2 * pos))) == (UINT32)(0x01 << (2 * pos));
 }
 
-static inline int is_busy(UINT16 bmap, int pos) {
+static inline int is_busy(UINT32 bmap, int pos) {
 	return (bmap & (0x02 << (2*pos))) != 0;
 }
 
-static inline int no_completed_entries(UINT16 bmap) {
-	return (bmap | 0xaaaa) == 0;
+//one bit (the high one) set for every busy entry
+static inline UINT32 busy_entries(UINT32 bmap) {
+	return bmap & STATE_HIGH_BITS;
+}
+
+//one bit (the low one) set for every pending entry
+static inline UINT32 pending_entries(UINT32 bmap) {
+	return bmap & ~(bmap >> 1) & STATE_LOW_BITS;
 }
 
-static inline int all_free(UINT16 bmap) {
+//one bit (the low one) set for every free entry
+static inline UINT32 free_entries(UINT32 bmap) {
+	return ~(bmap | (bmap >> 1)) & STATE_LOW_BITS;
+}
+
+static inline int entry_index(UINT32 mask) {
+	return __builtin_ctz(mask) / 2;
+}
+
+static inline int no_completed_entries(UINT32 bmap) {
+	return busy_entries(bmap) == 0;
+}
+
+static inline int all_free(UINT32 bmap) {
 	return (bmap == 0);
 }
 
-static inline UINT16 get_hash(UINT64 key) {
-	return (key / NUM_BUCKETS) % KEY_TO_HASH_MOD;
+static inline UINT16 get_hash(linkcache_t* cache, UINT64 key) {
+	return (key >> cache->bucket_shift) % KEY_TO_HASH_MOD;
 }
 
-static inline unsigned get_bucket(UINT64 key) {
-	return key % NUM_BUCKETS;
+static inline unsigned get_bucket(linkcache_t* cache, UINT64 key) {
+	return key & cache->bucket_mask;
 }
 
-static inline int find_free_index(UINT16 bmap) {
-	int i = 0;
-	while ((bmap & 0x03) != 0) {
-		bmap = bmap >> 2;
-		i++;
-		if (i == NUM_ENTRIES_PER_BUCKET) {
-			return -1;
-		}
+//set after an entry of the bucket becomes busy; the bit is only written if it is not set already, as a write-back
+//clearing it concurrently sees the busy entry and sets it again before releasing write_back_lock
+static inline void mark_bucket_dirty(linkcache_t* cache, unsigned bucket_num) {
+	volatile UINT64* shard = &cache->dirty[bucket_num / BUCKETS_PER_DIRTY_SHARD].buckets;
+	UINT64 bit = (UINT64)1 << (bucket_num % BUCKETS_PER_DIRTY_SHARD);
+	if ((*shard & bit) == 0) {
+		__sync_fetch_and_or(shard, bit);
 	}
-	return i;
 }
 
-static inline int no_free_index(UINT16 bmap) {
-	int i = 0;
-	while ((bmap & 0x03) != 0) {
-		bmap = bmap >> 2;
-		i++;
-		if (i == NUM_ENTRIES_PER_BUCKET) {
-			return 1;
-		}
+static inline int is_bucket_dirty(linkcache_t* cache, unsigned bucket_num) {
+	return (cache->dirty[bucket_num / BUCKETS_PER_DIRTY_SHARD].buckets >> (bucket_num % BUCKETS_PER_DIRTY_SHARD)) & 1;
+}
+
+//cleared once a write-back has completed, which then checks again whether some entry became busy
+static inline void mark_bucket_clean(linkcache_t* cache, unsigned bucket_num) {
+	volatile UINT64* shard = &cache->dirty[bucket_num / BUCKETS_PER_DIRTY_SHARD].buckets;
+	UINT64 bit = (UINT64)1 << (bucket_num % BUCKETS_PER_DIRTY_SHARD);
+	__sync_fetch_and_and(shard, ~bit);
+}
+
+static inline unsigned get_stash_bucket(linkcache_t* cache, unsigned bucket_num) {
+	return cache->num_buckets + (bucket_num & (cache->num_stash_buckets - 1));
+}
+
+//keys from several buckets share a stash bucket, so the hash keeps the low bits of the key
+static inline UINT16 get_stash_hash(UINT64 key) {
+	return key % KEY_TO_HASH_MOD;
+}
+
+static inline int find_free_index(UINT32 bmap) {
+	UINT32 free_mask = free_entries(bmap);
+	if (free_mask == 0) {
+		return -1;
 	}
-	return 0;
+	return entry_index(free_mask);
+}
+
+static inline int no_free_index(UINT32 bmap) {
+	return free_entries(bmap) == 0;
+}
+
+//compares all the hashes of a bucket at once; returns the same 2 bits per entry layout as the state (both bits set on a match)
+static inline UINT32 match_hashes(volatile bucket_t* bucket, UINT16 hash) {
+#ifdef __AVX2__
+	__m256i hashes = _mm256_loadu_si256((const __m256i*)bucket->hashes);
+	return (UINT32)_mm256_movemask_epi8(_mm256_cmpeq_epi16(hashes, _mm256_set1_epi16(hash)));
+#else
+	__m128i key = _mm_set1_epi16(hash);
+	UINT32 low = (UINT32)_mm_movemask_epi8(_mm_cmpeq_epi16(_mm_loadu_si128((const __m128i*)bucket->hashes), key));
+	UINT32 high = (UINT32)_mm_movemask_epi8(_mm_cmpeq_epi16(_mm_loadu_si128((const __m128i*)(bucket->hashes + 8)), key));
+	return low | (high << 16);
+#endif
 }
 
 static inline UINT_PTR mark_ptr_cache(UINT_PTR p) {
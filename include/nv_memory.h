@@ -1,21 +1,165 @@
 #ifndef _NV_MEMORY_H_
 #define _NV_MEMORY_H_
 
-#include "nv_utils.h" 
+#include <stdio.h>
+#include <immintrin.h>
 
-#define SIMULATE_LATENCIES 1
+#include "nv_utils.h"
 
-#define WAIT_WRITES_DELAY 370
-#define WRITE_DATA_WAIT_DELAY 370
-#define WRITE_DATA_NOWAIT_DELAY 9
+//defaults of the latency emulation model (roughly an Optane-class device); see nv_emulation_configure
+#define NV_EMUL_DEFAULT_WRITE_LATENCY_NS 150
+#define NV_EMUL_DEFAULT_FENCE_LATENCY_NS 20
+#define NV_EMUL_DEFAULT_BANDWIDTH_MBPS 2000
 
 
 /* contains functions for working with non-volatile memory */
 
 
-// TODO add operations to do moves from volatile memory to persistent memeory addresses using non-temporal stores
-// for examples, see https://github.com/pmem/nvml/blob/master/src/libpmem/pmem.c
+/*
+	the instruction used to write back cache lines is chosen at runtime (nv_memory_init),
+	so that the same build uses the best flush the host supports;
+	the latency simulator is only used if explicitly requested
+*/
+typedef enum nv_flush_mode_t {
+	NV_FLUSH_CLFLUSH = 0,
+	NV_FLUSH_CLFLUSHOPT,
+	NV_FLUSH_CLWB,
+	NV_FLUSH_SIMULATED
+} nv_flush_mode_t;
 
+extern nv_flush_mode_t nv_flush_mode;
+
+//pick the flush mode: the NV_FLUSH_MODE environment variable (clwb, clflushopt, clflush, simulate, auto) if set, the best one reported by CPUID otherwise
+//safe to call several times; only the first call has an effect
+void nv_memory_init();
+
+//force a flush mode (e.g., NV_FLUSH_SIMULATED); returns the mode actually set, which is the best supported one if the CPU does not support the requested instruction
+nv_flush_mode_t nv_set_flush_mode(nv_flush_mode_t mode);
+
+//the best flush instruction supported by the CPU
+nv_flush_mode_t nv_detect_flush_mode();
+
+const char* nv_flush_mode_name(nv_flush_mode_t mode);
+
+/*
+	latency emulation model used in NV_FLUSH_SIMULATED mode:
+	a written back line reaches persistence write_latency_ns after the device accepts it,
+	the device accepts the lines of each thread at bandwidth_mbps at most,
+	and a fence waits for the lines the calling thread has in flight, plus fence_latency_ns;
+	with shared_bandwidth, bandwidth_mbps is the limit of all threads together instead, which serializes
+	every emulated write-back on one shared counter: only meant to study saturation, not to measure the library
+*/
+typedef struct nv_emulation_config_t {
+	UINT64 write_latency_ns;
+	UINT64 fence_latency_ns;
+	UINT64 bandwidth_mbps; //0 means unlimited
+	UINT64 shared_bandwidth; //0 by default
+} nv_emulation_config_t;
+
+typedef struct nv_emulation_t {
+	ULONG64 write_latency_cycles;
+	ULONG64 fence_latency_cycles;
+	ULONG64 line_cycles; //time the device is busy with one line at the bandwidth cap
+	int shared_bandwidth;
+	double tsc_per_ns;
+} nv_emulation_t;
+
+extern nv_emulation_t nv_emulation;
+
+//time at which the device is done with all the lines it accepted so far, with shared_bandwidth
+extern volatile ULONG64 nv_device_busy_until;
+
+//time at which the device is done with the lines of this thread, otherwise
+extern __thread ULONG64 nv_thread_busy_until;
+
+//time at which all the write-backs issued by this thread are persistent
+extern __thread ULONG64 nv_pending_until;
+extern __thread ULONG64 nv_pending_lines;
+
+//set the model; with a NULL config, the NV_EMUL_WRITE_LATENCY_NS, NV_EMUL_FENCE_LATENCY_NS, NV_EMUL_BANDWIDTH_MBPS and NV_EMUL_SHARED_BANDWIDTH
+//environment variables are used, falling back to the defaults; calibrates the TSC on the first call
+void nv_emulation_configure(const nv_emulation_config_t* config);
+
+void nv_emulation_get_config(nv_emulation_config_t* config);
+
+//measured against CLOCK_MONOTONIC
+double nv_calibrate_tsc();
+
+/*
+	write_data_nowait issues the write-backs right away, only the fence is left to wait_writes;
+	write_data_deferred is the opt-in alternative for call sites that persist many small, overlapping ranges:
+	the lines are collected in a small per-thread set, and each distinct line is written back once, in address order,
+	by the next wait_writes, nv_persist_barrier or drain_deferred_writes (or earlier, when the set is full);
+	until then they are not even in flight
+*/
+#define NV_FLUSH_BUFFER_SIZE 32
+
+typedef struct nv_flush_buffer_t {
+	size_t num_lines;
+	UINT_PTR lines[NV_FLUSH_BUFFER_SIZE]; //sorted, no duplicates
+} nv_flush_buffer_t;
+
+extern __thread nv_flush_buffer_t nv_flush_buffer;
+
+//number of lines collected before they are written back; 0 makes write_data_deferred write back right away
+extern size_t nv_flush_batch;
+
+//returns the limit actually set (at most NV_FLUSH_BUFFER_SIZE)
+size_t nv_set_flush_batch(size_t lines);
+
+/*
+	persistence instrumentation, always on: per-thread counts of the lines written back, the fences actually issued,
+	and the cycles stalled waiting for write-backs, split by the part of the library that asked for them
+*/
+typedef enum nv_site_t {
+	NV_SITE_USER = 0, //the write_data_* / wait_writes calls made by applications
+	NV_SITE_LINK_CACHE,
+	NV_SITE_PAGE_TABLE,
+	NV_SITE_EPOCH,
+	NV_NUM_SITES
+} nv_site_t;
+
+typedef struct nv_site_stats_t {
+	UINT64 lines_flushed;
+	UINT64 fences;
+	UINT64 stall_cycles;
+} nv_site_stats_t;
+
+typedef CACHE_ALIGNED struct nv_thread_stats_t {
+	nv_site_stats_t sites[NV_NUM_SITES];
+	UINT64 cache_inserts;
+	UINT64 cache_inserts_tsx;
+	UINT64 cache_removes;
+	UINT64 cache_direct_links; //links persisted right away, because both their bucket and the stash were full
+	UINT64 cache_cas_failures; //failed CASes on the bucket headers
+	UINT64 page_marks;
+	UINT64 page_hits;
+	UINT64 page_mru_hits; //hits among the last few marked pages, without searching the table
+	struct nv_thread_stats_t* next;
+} nv_thread_stats_t;
+
+//allocated on the first use by a thread, and never freed, so that a snapshot still accounts for threads which are done
+extern __thread nv_thread_stats_t* nv_thread_stats;
+
+nv_thread_stats_t* nv_stats_register_thread();
+
+static inline nv_thread_stats_t* nv_stats() {
+	if (nv_thread_stats == NULL) {
+		return nv_stats_register_thread();
+	}
+	return nv_thread_stats;
+}
+
+//sums the counters of all threads; the counters are read without synchronization
+void nv_stats_snapshot(nv_thread_stats_t* total);
+
+void nv_stats_print(FILE* out, nv_thread_stats_t* stats);
+
+const char* nv_site_name(nv_site_t site);
+
+//encoded by hand so that no -mclflushopt / -mclwb is needed at compile time
+#define _mm_clflushopt(addr) asm volatile(".byte 0x66; clflush %0" : "+m" (*(volatile char *)(addr)))
+#define _mm_clwb(addr) asm volatile(".byte 0x66; xsaveopt %0" : "+m" (*(volatile char *)(addr)))
 
 
 static inline size_t num_cache_lines(size_t size_bytes) {
@@ -23,97 +167,230 @@ static inline size_t num_cache_lines(size_t size_bytes) {
 	return (((size_bytes - 1)/ CACHE_LINE_SIZE) + 1);
 }
 
-#ifdef NEW_INTEL_INSTRUCTIONS
+static inline size_t lines_spanned(void* addr, size_t sz) {
+	if (sz == 0) return 0;
+	return (((UINT_PTR)addr + sz - 1) / CACHE_LINE_SIZE) - ((UINT_PTR)addr / CACHE_LINE_SIZE) + 1;
+}
 
-#define _mm_clflushopt(addr) asm volatile(".byte 0x66; clflush %0" : "+m" (*(volatile char *)addr));
-#define _mm_clwb(addr) asm volatile(".byte 0x66; xsaveopt %0" : "+m" (*(volatile char *)addr));
+static inline void emulate_write_back(size_t lines) {
+	ULONG64 now = nv_getticks();
+	ULONG64 done = now;
 
-static inline void wait_writes() {
-	_mm_sfence();
+	if (nv_emulation.line_cycles != 0) {
+		if (nv_emulation.shared_bandwidth) {
+			ULONG64 busy;
+			do {
+				busy = nv_device_busy_until;
+				done = ((busy > now) ? busy : now) + lines * nv_emulation.line_cycles;
+			} while (CAS_U64(&nv_device_busy_until, busy, done) != busy);
+		}
+		else {
+			done = ((nv_thread_busy_until > now) ? nv_thread_busy_until : now) + lines * nv_emulation.line_cycles;
+			nv_thread_busy_until = done;
+		}
+	}
+	done += nv_emulation.write_latency_cycles;
+
+	if (done > nv_pending_until) {
+		nv_pending_until = done;
+	}
+	nv_pending_lines += lines;
 }
 
-static inline void write_data_nowait(void* addr, size_t sz) {
-	UINT_PTR p;
+static inline void emulate_fence() {
+	if (nv_pending_lines == 0) {
+		//nothing in flight
+		return;
+	}
 
-	for (p = (UINT_PTR)adddr & ~(CACHE_LINE_SIZE - 1; p < (UINT_PTR)addr + sz; p += CACHE_LINE_SIZE) {
-		_mm_clwb((void*)p);
+	ULONG64 endCycles = nv_pending_until + nv_emulation.fence_latency_cycles;
+	while (nv_getticks() < endCycles) {
+		_mm_pause();
 	}
+	nv_pending_lines = 0;
 }
 
-static inline void write_data_wait(void* addr, size_t sz) {
+static inline void flush_lines(void* addr, size_t sz) {
 	UINT_PTR p;
 
-		for (p = (UINT_PTR)adddr & ~(CACHE_LINE_SIZE - 1; p < (UINT_PTR)addr + sz; p += CACHE_LINE_SIZE) {
+	switch (nv_flush_mode) {
+	case NV_FLUSH_CLWB:
+		for (p = (UINT_PTR)addr & ~(CACHE_LINE_SIZE - 1); p < (UINT_PTR)addr + sz; p += CACHE_LINE_SIZE) {
 			_mm_clwb((void*)p);
 		}
-	_mm_sfence();
+		break;
+	case NV_FLUSH_CLFLUSHOPT:
+		for (p = (UINT_PTR)addr & ~(CACHE_LINE_SIZE - 1); p < (UINT_PTR)addr + sz; p += CACHE_LINE_SIZE) {
+			_mm_clflushopt((void*)p);
+		}
+		break;
+	default:
+		for (p = (UINT_PTR)addr & ~(CACHE_LINE_SIZE - 1); p < (UINT_PTR)addr + sz; p += CACHE_LINE_SIZE) {
+			_mm_clflush((void*)p);
+		}
+		break;
+	}
+}
+
+static inline void flush_line(UINT_PTR p) {
+	switch (nv_flush_mode) {
+	case NV_FLUSH_CLWB:
+		_mm_clwb((void*)p);
+		break;
+	case NV_FLUSH_CLFLUSHOPT:
+		_mm_clflushopt((void*)p);
+		break;
+	default:
+		_mm_clflush((void*)p);
+		break;
+	}
 }
 
-#else
+//the lines were counted against the sites that deferred them
+static inline void drain_flush_buffer() {
+	size_t i;
+	size_t n = nv_flush_buffer.num_lines;
 
-#define _mm_clflushopt(addr) _mm_clflush(addr)
-#define _mm_clwb(addr) _mm_clflush(addr)
+	if (n == 0) {
+		return;
+	}
+	if (nv_flush_mode == NV_FLUSH_SIMULATED) {
+		emulate_write_back(n);
+	}
+	else {
+		for (i = 0; i < n; i++) {
+			flush_line(nv_flush_buffer.lines[i]);
+		}
+	}
+	nv_flush_buffer.num_lines = 0;
+}
 
+static inline void buffer_line(UINT_PTR line, nv_site_t site) {
+	size_t n = nv_flush_buffer.num_lines;
+	size_t i = n;
 
-static inline void wait_writes() {
-#ifdef SIMULATE_LATENCIES
-	ULONG64 startCycles = nv_getticks();
-	ULONG64 endCycles = startCycles + WAIT_WRITES_DELAY;
-	ULONG64 cycles = startCycles;
+	//insertion sort; the set is small, and consecutive calls often hit the same or increasing lines
+	while ((i > 0) && (nv_flush_buffer.lines[i - 1] > line)) {
+		i--;
+	}
+	if ((i > 0) && (nv_flush_buffer.lines[i - 1] == line)) {
+		return;
+	}
+	if (n >= nv_flush_batch) {
+		drain_flush_buffer();
+		n = 0;
+		i = 0;
+	}
+	for (; n > i; n--) {
+		nv_flush_buffer.lines[n] = nv_flush_buffer.lines[n - 1];
+	}
+	nv_flush_buffer.lines[i] = line;
+	nv_flush_buffer.num_lines++;
+	nv_stats()->sites[site].lines_flushed++;
+}
 
-	while (cycles < endCycles) {
-		cycles = nv_getticks();
+//the deferred lines are written back first; the fences and the stall are only accounted when a fence is actually issued
+static inline void wait_writes_at(nv_site_t site) {
+	ULONG64 start;
+
+	drain_flush_buffer();
+
+	switch (nv_flush_mode) {
+	case NV_FLUSH_CLFLUSH:
+		//clflush is ordered with respect to other writes, no fence needed
+		return;
+	case NV_FLUSH_SIMULATED:
+		start = nv_getticks();
+		emulate_fence();
+		_mm_sfence();
+		break;
+	default:
+		start = nv_getticks();
+		_mm_sfence();
+		break;
 	}
-	_mm_sfence();
-#else
-	//_mm_sfence();
-#endif
+
+	nv_site_stats_t* stats = &nv_stats()->sites[site];
+	stats->fences++;
+	stats->stall_cycles += nv_getticks() - start;
 }
 
-//size is in terms of number of cache lines
-static inline void write_data_wait(void* addr, size_t sz) {
-#ifdef SIMULATE_LATENCIES
-	ULONG64 startCycles =nv_getticks();
-	ULONG64 endCycles = startCycles + WRITE_DATA_WAIT_DELAY;
-	ULONG64 cycles = startCycles;
+//sz is in bytes: every cache line overlapping [addr, addr + sz) is written back
+static inline void write_data_nowait_at(void* addr, size_t sz, nv_site_t site) {
+	size_t lines = lines_spanned(addr, sz);
+	if (nv_flush_mode == NV_FLUSH_SIMULATED) {
+		//only record when the lines will be persistent, the wait happens at the next fence
+		emulate_write_back(lines);
+	}
+	else {
+		flush_lines(addr, sz);
+	}
+	nv_stats()->sites[site].lines_flushed += lines;
+}
 
-    //fprintf(stderr, "here\n");
-	while (cycles < endCycles) {
-		cycles = nv_getticks();
-        _mm_pause();
+//the lines are only collected, and written back by the next wait_writes
+static inline void write_data_deferred_at(void* addr, size_t sz, nv_site_t site) {
+	if (nv_flush_batch == 0) {
+		write_data_nowait_at(addr, sz, site);
+		return;
 	}
-	_mm_sfence();
-#else
-	UINT_PTR p;
 
+	UINT_PTR p;
 	for (p = (UINT_PTR)addr & ~(CACHE_LINE_SIZE - 1); p < (UINT_PTR)addr + sz; p += CACHE_LINE_SIZE) {
-		_mm_clflush((void*)p);
+		buffer_line(p, site);
 	}
-#endif
+}
+
+static inline void write_data_wait_at(void* addr, size_t sz, nv_site_t site) {
+	write_data_nowait_at(addr, sz, site);
+	wait_writes_at(site);
+}
+
+static inline void wait_writes() {
+	wait_writes_at(NV_SITE_USER);
 }
 
 static inline void write_data_nowait(void* addr, size_t sz) {
-#ifdef SIMULATE_LATENCIES
-	//this might just take a few cycles if we are not waiting for the op to complete
-	//just reading rdtsc may take a few tens of cycles
-	//so perhaps better to just do a pause
-	if (WRITE_DATA_NOWAIT_DELAY < 10) {
-		_mm_pause();
-	}
-	else {
-		ULONG64 startCycles = nv_getticks();
-		ULONG64 endCycles = startCycles + WRITE_DATA_NOWAIT_DELAY;
-		ULONG64 cycles = startCycles;
+	write_data_nowait_at(addr, sz, NV_SITE_USER);
+}
 
-		while (cycles < endCycles) {
-			cycles = nv_getticks();
-		}
+static inline void write_data_wait(void* addr, size_t sz) {
+	write_data_wait_at(addr, sz, NV_SITE_USER);
+}
+
+static inline void write_data_deferred(void* addr, size_t sz) {
+	write_data_deferred_at(addr, sz, NV_SITE_USER);
+}
+
+//write back the deferred lines; a fence is still needed for them to be durable
+static inline void drain_deferred_writes() {
+	drain_flush_buffer();
+}
+
+//write back everything this thread has pending, deferred lines included, and fence regardless of the flush instruction
+static inline void nv_persist_barrier() {
+	ULONG64 start = nv_getticks();
+
+	drain_flush_buffer();
+	if (nv_flush_mode == NV_FLUSH_SIMULATED) {
+		emulate_fence();
 	}
-#else
-	write_data_wait(addr, sz);
-#endif
+	_mm_sfence();
+
+	nv_site_stats_t* stats = &nv_stats()->sites[NV_SITE_USER];
+	stats->fences++;
+	stats->stall_cycles += nv_getticks() - start;
 }
 
-#endif
+/*
+	moves from volatile to persistent memory using non-temporal stores (see https://github.com/pmem/nvml/blob/master/src/libpmem/pmem.c);
+	the destination is persistent when the call returns: the cache is bypassed and there is a single fence at the end;
+	copies smaller than NV_MOVNT_THRESHOLD go through the cache and are flushed line by line instead
+*/
+#define NV_MOVNT_THRESHOLD 256
+
+void* nv_memcpy_persist(void* dest, const void* src, size_t len);
+
+void* nv_memset_persist(void* dest, int c, size_t len);
 
 #endif
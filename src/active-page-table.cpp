@@ -2,51 +2,449 @@
 
 #include "active-page-table.h"
 
-__thread char path[32];
+/*
+	a single pool, shared by the tables of all the threads; creating a table is an allocation from it
+*/
+static PMEMobjpool* volatile apt_pool = NULL;
+static pthread_mutex_t apt_pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static char apt_pool_dir[256];
+static size_t apt_pool_size = 0;
+static char apt_pool_path[512];
+
+void active_page_pool_configure(const char* dir, size_t size) {
+	pthread_mutex_lock(&apt_pool_lock);
+	if (dir != NULL) {
+		snprintf(apt_pool_dir, sizeof(apt_pool_dir), "%s", dir);
+	}
+	apt_pool_size = size;
+	pthread_mutex_unlock(&apt_pool_lock);
+}
 
-static __thread PMEMobjpool *pop;
+/*
+	sets the path of the pool file and returns the size of the pool; called with the lock held
+*/
+static size_t apt_pool_resolve() {
+	const char* dir = apt_pool_dir;
+	if (dir[0] == 0) {
+		dir = getenv("NV_APT_DIR");
+	}
+	if (dir == NULL || dir[0] == 0) {
+		dir = APT_POOL_DIR;
+	}
+	snprintf(apt_pool_path, sizeof(apt_pool_path), "%s/%s", dir, APT_POOL_FILE);
 
-active_page_table_t* allocate_apt(UINT32 id) {
+	size_t size = apt_pool_size;
+	const char* size_mb = getenv("NV_APT_POOL_MB");
+	if (size == 0 && size_mb != NULL) {
+		size = (size_t)strtoul(size_mb, NULL, 10) * 1024 * 1024;
+	}
+	if (size == 0) {
+		size = APT_POOL_SIZE;
+	}
+	return size;
+}
 
-    //char path[32];
-    sprintf(path, "/tmp/thread_%u", id); //thread id as file name
+static PMEMoid first_apt(PMEMoid oid);
 
-    //remove file if it exists
-    //TODO might want to remove this instruction in the future
-    remove(path);
+/*
+	opens the pool on first use; the file of a previous run is kept, with its tables, for the recovery,
+	and only removed by active_page_pool_close
+*/
+static PMEMobjpool* get_apt_pool() {
+	if (apt_pool != NULL) {
+		return apt_pool;
+	}
 
-	pop = NULL;
+	pthread_mutex_lock(&apt_pool_lock);
+	if (apt_pool == NULL) {
+		size_t size = apt_pool_resolve();
+		PMEMobjpool* pool;
 
-	if (access(path, F_OK) != 0) {
-        if ((pop = pmemobj_create(path, POBJ_LAYOUT_NAME(apt),
-            APT_POOL_SIZE, S_IWUSR | S_IRUSR)) == NULL) {
-            printf("failed to create pool1 wiht name %s\n", path);
-            return NULL;
-        }
-    } else {
-        if ((pop = pmemobj_open(path, LAYOUT_NAME)) == NULL) {
-            printf("failed to open pool with name %s\n", path);
-            return NULL;
-        }
-    }
-    
-	//zeroed allocation if the object does not exist yet
-    TOID(active_page_table_t) apt = POBJ_ROOT(pop, active_page_table_t);
+		if (access(apt_pool_path, F_OK) == 0) {
+			pool = pmemobj_open(apt_pool_path, POBJ_LAYOUT_NAME(apt));
+			if (pool == NULL) {
+				printf("failed to open pool with name %s\n", apt_pool_path);
+			}
+			else if (!OID_IS_NULL(first_apt(pmemobj_first(pool)))) {
+				//active_page_pool_open would have opened the pool already: the new tables are added next to the old ones
+				fprintf(stderr, "pool %s holds tables of a previous run that were not recovered\n", apt_pool_path);
+			}
+		}
+		else {
+			pool = pmemobj_create(apt_pool_path, POBJ_LAYOUT_NAME(apt), size, S_IWUSR | S_IRUSR);
+			if (pool == NULL) {
+				printf("failed to create pool with name %s\n", apt_pool_path);
+			}
+		}
+		apt_pool = pool;
+	}
+	pthread_mutex_unlock(&apt_pool_lock);
+
+	return apt_pool;
+}
+
+void active_page_pool_close(int remove_file) {
+	pthread_mutex_lock(&apt_pool_lock);
+	if (apt_pool != NULL) {
+		pmemobj_close(apt_pool);
+		if (remove_file) {
+			remove(apt_pool_path);
+		}
+		apt_pool = NULL;
+	}
+	pthread_mutex_unlock(&apt_pool_lock);
+}
+
+/*
+	the table starts at the first cache line boundary of its allocation, so that
+	tables of different threads never share a line
+*/
+static inline active_page_table_t* apt_of(PMEMoid oid) {
+	return (active_page_table_t*)(((UINT_PTR)pmemobj_direct(oid) + CACHE_LINE_SIZE - 1) & ~((UINT_PTR)CACHE_LINE_SIZE - 1));
+}
+
+static PMEMoid first_apt(PMEMoid oid) {
+	while (!OID_IS_NULL(oid) && pmemobj_type_num(oid) != TOID_TYPE_NUM(active_page_table_t)) {
+		oid = pmemobj_next(oid);
+	}
+	return oid;
+}
+
+int active_page_pool_open() {
+	pthread_mutex_lock(&apt_pool_lock);
+	if (apt_pool == NULL) {
+		apt_pool_resolve();
+		if (access(apt_pool_path, F_OK) == 0) {
+			apt_pool = pmemobj_open(apt_pool_path, POBJ_LAYOUT_NAME(apt));
+			if (apt_pool == NULL) {
+				printf("failed to open pool with name %s\n", apt_pool_path);
+			}
+		}
+	}
+	pthread_mutex_unlock(&apt_pool_lock);
+
+	if (apt_pool == NULL) {
+		return -1;
+	}
+
+	int num_tables = 0;
+	for (PMEMoid oid = first_apt(pmemobj_first(apt_pool)); !OID_IS_NULL(oid); oid = first_apt(pmemobj_next(oid))) {
+		num_tables++;
+	}
+	return num_tables;
+}
+
+size_t active_page_pool_for_each_page(active_page_fun fun, void* context) {
+	size_t num_pages = 0;
+
+	for (PMEMoid oid = first_apt(pmemobj_first(apt_pool)); !OID_IS_NULL(oid); oid = first_apt(pmemobj_next(oid))) {
+		active_page_table_t* table = apt_of(oid);
+		if (table->page_size == 0) {
+			continue; //allocated, but never initialized
+		}
+
+		//the index of the previous run is gone, the whole chain is scanned
+		for (page_segment_t* segment = &table->first_segment; segment != NULL; segment = (page_segment_t*)pmemobj_direct(segment->next)) {
+			for (size_t i = 0; i < SEGMENT_PAGES; i++) {
+				if (segment->pages[i] != NULL) {
+					fun(segment->pages[i], table->page_size, table->thread_id, context);
+					num_pages++;
+				}
+			}
+		}
+	}
+	return num_pages;
+}
+
+void active_page_pool_free_tables() {
+	PMEMoid oid;
+
+	while (!OID_IS_NULL(oid = first_apt(pmemobj_first(apt_pool)))) {
+		active_page_table_t* table = apt_of(oid);
+
+		//segments are freed from the last one, so that the chain stays valid
+		while (!OID_IS_NULL(table->first_segment.next)) {
+			page_segment_t* prev = &table->first_segment;
+			page_segment_t* last = (page_segment_t*)pmemobj_direct(prev->next);
+			while (!OID_IS_NULL(last->next)) {
+				prev = last;
+				last = (page_segment_t*)pmemobj_direct(last->next);
+			}
+			pmemobj_free(&prev->next);
+		}
+		pmemobj_free(&oid);
+	}
+}
+
+static active_page_table_t* allocate_apt(UINT32 id, PMEMoid* oid) {
+	PMEMobjpool* pool = get_apt_pool();
+	if (pool == NULL) {
+		return NULL;
+	}
+
+	//zeroed allocation, with a spare cache line for the alignment
+	if (pmemobj_zalloc(pool, oid, sizeof(active_page_table_t) + CACHE_LINE_SIZE, TOID_TYPE_NUM(active_page_table_t)) != 0) {
+		printf("failed to allocate the table of thread %u\n", id);
+		return NULL;
+	}
+	return apt_of(*oid);
+}
+
+static inline size_t page_index_hash(page_index_t* index, void* page) {
+	return (size_t)((((UINT_PTR)page >> index->page_shift) * 0x9E3779B97F4A7C15ULL) >> (64 - index->slots_bits));
+}
+
+static inline size_t page_index_mask(page_index_t* index) {
+	return ((size_t)1 << index->slots_bits) - 1;
+}
+
+//position of page in the table, or SIZE_MAX if it is not there
+static size_t page_index_find(active_page_table_t* table, void* page) {
+	page_index_t* index = table->index;
+	size_t h;
+
+	for (h = page_index_hash(index, page); index->slots[h] != 0; h = (h + 1) & page_index_mask(index)) {
+		if (*page_entry(table, index->slots[h] - 1) == page) {
+			return index->slots[h] - 1;
+		}
+	}
+	return SIZE_MAX;
+}
+
+static void page_index_insert(active_page_table_t* table, size_t position) {
+	page_index_t* index = table->index;
+	size_t h;
+
+	for (h = page_index_hash(index, *page_entry(table, position)); index->slots[h] != 0; h = (h + 1) & page_index_mask(index)) {
+	}
+	index->slots[h] = (UINT32)(position + 1);
+}
+
+//must be called while the entry at position still holds the page
+static void page_index_remove(active_page_table_t* table, size_t position) {
+	page_index_t* index = table->index;
+	size_t mask = page_index_mask(index);
+	size_t h, next, home;
+
+	for (h = page_index_hash(index, *page_entry(table, position)); index->slots[h] != position + 1; h = (h + 1) & mask) {
+	}
+	index->slots[h] = 0;
+
+	//move back the entries of the probe sequence which could not be found anymore
+	for (next = (h + 1) & mask; index->slots[next] != 0; next = (next + 1) & mask) {
+		home = page_index_hash(index, *page_entry(table, index->slots[next] - 1));
+		if (((next - home) & mask) >= ((next - h) & mask)) {
+			index->slots[h] = index->slots[next];
+			index->slots[next] = 0;
+			h = next;
+		}
+	}
+}
+
+//number of positions in the segments of the table
+static inline size_t page_index_capacity(page_index_t* index) {
+	return index->num_segments * SEGMENT_PAGES;
+}
+
+//makes sure the slots are at most half full once all the positions are in use, rehashing the pages if they are not
+static void page_index_reserve_slots(active_page_table_t* table) {
+	page_index_t* index = table->index;
+	size_t i;
+
+	if ((index->slots != NULL) && (((size_t)1 << index->slots_bits) >= 2 * page_index_capacity(index))) {
+		return;
+	}
+	while (((size_t)1 << index->slots_bits) < 2 * page_index_capacity(index)) {
+		index->slots_bits++;
+	}
+	free(index->slots);
+	index->slots = (UINT32*)calloc((size_t)1 << index->slots_bits, sizeof(UINT32));
+	for (i = 0; i < page_index_capacity(index); i++) {
+		if (*page_entry(table, i) != NULL) {
+			page_index_insert(table, i);
+		}
+	}
+}
+
+//adds a segment at the end of the volatile copy of the chain; its positions are not free until last_in_use covers them
+static void page_index_attach_segment(active_page_table_t* table, page_segment_t* segment) {
+	page_index_t* index = table->index;
+	size_t old_words = page_index_capacity(index) / 64;
+	size_t old_summary = (old_words + 63) / 64;
+
+	index->segments = (page_segment_t**)realloc(index->segments, (index->num_segments + 1) * sizeof(page_segment_t*));
+	index->segments[index->num_segments++] = segment;
+
+	size_t words = page_index_capacity(index) / 64;
+	size_t summary = (words + 63) / 64;
+	index->free_bits = (UINT64*)realloc(index->free_bits, words * sizeof(UINT64));
+	memset(&index->free_bits[old_words], 0, (words - old_words) * sizeof(UINT64));
+	index->free_summary = (UINT64*)realloc(index->free_summary, summary * sizeof(UINT64));
+	memset(&index->free_summary[old_summary], 0, (summary - old_summary) * sizeof(UINT64));
+	index->times = (page_times_t*)realloc(index->times, page_index_capacity(index) * sizeof(page_times_t));
+	memset(&index->times[page_index_capacity(index) - SEGMENT_PAGES], 0, SEGMENT_PAGES * sizeof(page_times_t));
+}
+
+static void page_index_free(page_index_t* index) {
+	free(index->segments);
+	free(index->times);
+	free(index->slots);
+	free(index->free_bits);
+	free(index->free_summary);
+	free(index);
+}
+
+static inline void free_position_set(page_index_t* index, size_t position) {
+	index->free_bits[position / 64] |= (UINT64)1 << (position % 64);
+	index->free_summary[position / 4096] |= (UINT64)1 << ((position / 64) % 64);
+}
+
+static inline void free_position_clear(page_index_t* index, size_t position) {
+	index->free_bits[position / 64] &= ~((UINT64)1 << (position % 64));
+	if (index->free_bits[position / 64] == 0) {
+		index->free_summary[position / 4096] &= ~((UINT64)1 << ((position / 64) % 64));
+	}
+}
+
+//empty positions are handed out lowest first, so that the used part of the table can shrink; SIZE_MAX if there is none
+static inline size_t free_position_take(page_index_t* index) {
+	size_t s;
+	size_t summary = (page_index_capacity(index) / 64 + 63) / 64;
+
+	for (s = 0; s < summary; s++) {
+		if (index->free_summary[s] != 0) {
+			size_t word = s * 64 + __builtin_ctzll(index->free_summary[s]);
+			size_t position = word * 64 + __builtin_ctzll(index->free_bits[word]);
+			free_position_clear(index, position);
+			return position;
+		}
+	}
+	return SIZE_MAX;
+}
+
+//whether all the positions in [from, to) are empty; both are multiples of 64
+static inline int free_positions_all(page_index_t* index, size_t from, size_t to) {
+	size_t w;
+
+	for (w = from / 64; w < to / 64; w++) {
+		if (index->free_bits[w] != ~(UINT64)0) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+//the positions in [from, to) are not usable anymore; both are multiples of 64
+static inline void free_positions_remove(page_index_t* index, size_t from, size_t to) {
+	size_t w;
 
-	//I should now return a pointer to this 
-	return D_RW(apt);
+	for (w = from / 64; w < to / 64; w++) {
+		index->free_bits[w] = 0;
+		index->free_summary[w / 64] &= ~((UINT64)1 << (w % 64));
+	}
+}
+
+static void page_index_rebuild_free(active_page_table_t* table) {
+	page_index_t* index = table->index;
+	size_t i;
+
+	memset(index->free_bits, 0, (page_index_capacity(index) / 64) * sizeof(UINT64));
+	memset(index->free_summary, 0, ((page_index_capacity(index) / 64 + 63) / 64) * sizeof(UINT64));
+	for (i = 0; i < table->last_in_use; i++) {
+		if (*page_entry(table, i) == NULL) {
+			free_position_set(index, i);
+		}
+	}
+}
+
+static inline void page_mru_push(page_index_t* index, void* page, size_t position) {
+	memmove(&index->mru[1], &index->mru[0], (PAGE_MRU_SIZE - 1) * sizeof(page_mru_entry_t));
+	index->mru[0].page = page;
+	index->mru[0].position = position;
+}
+
+static inline void page_mru_clear(page_index_t* index) {
+	memset(index->mru, 0, sizeof(index->mru));
+}
+
+//a page removed from the table could still be in the MRU
+static inline void page_mru_forget(page_index_t* index, size_t position) {
+	size_t m;
+
+	for (m = 0; m < PAGE_MRU_SIZE; m++) {
+		if ((index->mru[m].page != NULL) && (index->mru[m].position == position)) {
+			index->mru[m].page = NULL;
+		}
+	}
+}
+
+//rebuild the volatile index from the persistent pages, following the chain of segments
+static void page_index_rebuild(active_page_table_t* table) {
+	page_index_t* index = (page_index_t*)calloc(1, sizeof(page_index_t));
+	PMEMoid next;
+
+	table->index = index;
+	index->page_shift = __builtin_ctzl(table->page_size);
+	index->clean_cursor = SIZE_MAX;
+	page_index_attach_segment(table, &table->first_segment);
+	for (next = table->first_segment.next; !OID_IS_NULL(next); next = index->segments[index->num_segments - 1]->next) {
+		page_index_attach_segment(table, (page_segment_t*)pmemobj_direct(next));
+	}
+	page_index_reserve_slots(table);
+	page_index_rebuild_free(table);
+}
+
+/*
+	links a new, zeroed segment at the end of the chain; NULL if the pool is full
+*/
+static page_segment_t* add_segment(active_page_table_t* table) {
+	page_segment_t* last = table->index->segments[table->index->num_segments - 1];
+
+	//the allocation is zeroed and stored in the link in a failure atomic way
+	if (pmemobj_zalloc(apt_pool, &last->next, sizeof(page_segment_t), TOID_TYPE_NUM(page_segment_t)) != 0) {
+		return NULL;
+	}
+	page_segment_t* segment = (page_segment_t*)pmemobj_direct(last->next);
+	page_index_attach_segment(table, segment);
+	page_index_reserve_slots(table);
+	return segment;
+}
+
+/*
+	unlinks and frees the last segment, whose positions must all be empty
+*/
+static void drop_last_segment(active_page_table_t* table) {
+	page_index_t* index = table->index;
+
+	free_positions_remove(index, page_index_capacity(index) - SEGMENT_PAGES, page_index_capacity(index));
+	index->num_segments--;
+	//frees the segment and clears the link in a failure atomic way
+	pmemobj_free(&index->segments[index->num_segments - 1]->next);
 }
 
 /*
 	creates a page buffer with a certain number of preallocated free entries
 */
 active_page_table_t* create_active_page_table(UINT32 id) {
+	return create_active_page_table_with_page_size(id, PAGE_SIZE);
+}
+
+active_page_table_t* create_active_page_table_with_page_size(UINT32 id, size_t page_size) {
 
 	active_page_table_t* new_buffer = NULL;
+	PMEMoid oid;
 
-	new_buffer = allocate_apt(id); //zeroed allocation
+	new_buffer = allocate_apt(id, &oid); //zeroed allocation
+	if (new_buffer == NULL) {
+		return NULL;
+	}
 
-	new_buffer->page_size = PAGE_SIZE;
+	size_t size = PAGE_SIZE;
+	while (size < page_size) {
+		size <<= 1;
+	}
+	new_buffer->thread_id = id;
+	new_buffer->page_size = size; //persisted with the rest of the header below
 	new_buffer->current_size = 0;
     new_buffer->last_in_use= 0;
 
@@ -55,9 +453,12 @@ active_page_table_t* create_active_page_table(UINT32 id) {
 #endif
 
 	new_buffer->last_in_use = DEFAULT_PAGE_BUFFER_SIZE;
-	write_data_nowait(new_buffer, 1);
+	write_data_nowait_at(new_buffer, 1, NV_SITE_PAGE_TABLE);
 
-	wait_writes();
+	wait_writes_at(NV_SITE_PAGE_TABLE);
+
+	page_index_rebuild(new_buffer);
+	new_buffer->index->oid = oid;
 	return new_buffer;
 }
 
@@ -65,154 +466,235 @@ active_page_table_t* create_active_page_table(UINT32 id) {
 	frees all the memory associated with a page buffer
 */
 void destroy_active_page_table(active_page_table_t* active_page_table) {
-	
-	pmemobj_close(pop);
+	page_index_t* index = active_page_table->index;
+	PMEMoid oid = index->oid;
+
+	//segments are freed from the last one, so that the chain stays valid
+	while (index->num_segments > 1) {
+		index->num_segments--;
+		pmemobj_free(&index->segments[index->num_segments - 1]->next);
+	}
+	page_index_free(index);
+	active_page_table->index = NULL;
 
-    remove(path);
+	pmemobj_free(&oid);
 }
 
 /*
-	clears all the entries in the buffer;
+	frees the volatile index of the table only, leaving the table in the pool as a crash would
 */
-void clear_buffer(active_page_table_t* buffer, EpochTsVal cleanTs, EpochTsVal currTs) {
-    size_t max_seen = 0;
+void forget_active_page_table(active_page_table_t* active_page_table) {
+	page_index_free(active_page_table->index);
+	active_page_table->index = NULL;
+}
+
+/*
+	starts a clean up pass over the entries of the buffer;
+	the timestamps are the ones of the whole pass, pages marked since are more recent and are kept
+*/
+static void clean_start(active_page_table_t* buffer, EpochTsVal cleanTs, EpochTsVal currTs) {
 #ifdef BUFFERING_ON
 	if (buffer->shared_flush_buffer != NULL) {
 		//fprintf(stderr, "clearing page buffer\n");
 		cache_wb_all_buckets(buffer->shared_flush_buffer);
 	}
 #endif
+	buffer->index->clean_cursor = 0;
+	buffer->index->clean_ts = cleanTs;
+	buffer->index->clean_curr_ts = currTs;
+}
 
-	size_t i;
-
-
-    for (i = 0; i < buffer->last_in_use; i++) {
-        if ((buffer->pages[i].page!=NULL) && ((buffer->pages[i].lastTsAccess < cleanTs) || (buffer->pages[i].lastTsAccess == 0)) && ((buffer->pages[i].lastTsIns < currTs) || (buffer->pages[i].lastTsIns == 0))) {
-            buffer->pages[i].page = NULL;
-            buffer->pages[i].lastTsAccess = EPOCH_FIRST_EPOCH;
+/*
+	cleans up to steps entries from the cursor; at the end of the pass, drops the empty segments at the end of the chain,
+	or halves the search space in the first segment if its last half is empty
+*/
+static void clean_step(active_page_table_t* buffer, size_t steps) {
+	page_index_t* index = buffer->index;
+	EpochTsVal cleanTs = index->clean_ts;
+	EpochTsVal currTs = index->clean_curr_ts;
+	size_t i = index->clean_cursor;
+	size_t end = ((buffer->last_in_use - i) > steps) ? (i + steps) : buffer->last_in_use;
+
+    for (; i < end; i++) {
+        void** entry = page_entry(buffer, i);
+        page_times_t* times = page_times(buffer, i);
+        if ((*entry!=NULL) && ((times->lastTsAccess < cleanTs) || (times->lastTsAccess == 0)) && ((times->lastTsIns < currTs) || (times->lastTsIns == 0))) {
+            page_index_remove(buffer, i);
+            page_mru_forget(index, i);
+            *entry = NULL;
+            times->lastTsAccess = EPOCH_FIRST_EPOCH;
             buffer->current_size--;
+            free_position_set(index, i);
             //fprintf(stderr, "removing entry, current size is %d \n", buffer->current_size);
-        } else {
-            //if (buffer->pages[i].page!=NULL) {
-             ////fprintf(stderr, "%lu %lu %lu %lu\n", buffer->pages[i].lastTsAccess, cleanTs, buffer->pages[i].lastTsIns, currTs);
-            //}
         }
-        if ((buffer->pages[i].page != NULL) && (i > max_seen)) {
-            max_seen = i;
-        }   
+    }
+    index->clean_cursor = end;
+    if (end < buffer->last_in_use) {
+        return;
     }
 
-    //decrease search size if last half is empty
-    size_t half = buffer->last_in_use/2;
-    if ((max_seen < half) && (half > DEFAULT_PAGE_BUFFER_SIZE)) {
-       buffer->last_in_use = half;
+    if (buffer->last_in_use > SEGMENT_PAGES) {
+        //the last segment is in use up to its end
+        while ((buffer->last_in_use > SEGMENT_PAGES) && free_positions_all(index, buffer->last_in_use - SEGMENT_PAGES, buffer->last_in_use)) {
+            buffer->last_in_use -= SEGMENT_PAGES;
+            drop_last_segment(buffer);
+        }
+    }
+    else {
+        //decrease search size if last half is empty
+        size_t half = buffer->last_in_use/2;
+        if ((half > DEFAULT_PAGE_BUFFER_SIZE) && free_positions_all(index, half, buffer->last_in_use)) {
+           free_positions_remove(index, half, buffer->last_in_use);
+           buffer->last_in_use = half;
+        }
     }
 
+	index->clean_cursor = SIZE_MAX;
 	buffer->clear_all = 0;
 	// no need to persist this now
 }
 
+/*
+	clears all the entries in the buffer;
+*/
+void clear_buffer(active_page_table_t* buffer, EpochTsVal cleanTs, EpochTsVal currTs) {
+	clean_start(buffer, cleanTs, currTs);
+	clean_step(buffer, SIZE_MAX);
+}
+
 /*
 	mark a page as having data that was either allocated or freed in the current epoch
 */
 
-void mark_page(active_page_table_t* pages, void* ptr,  int allocation_size, EpochTsVal currentTs, EpochTsVal collectTs, int isRemove) {
+static inline void touch_page(page_times_t* times, EpochTsVal currentTs, int isRemove) {
+	if (isRemove) {
+		if (times->lastTsAccess < currentTs) {
+			times->lastTsAccess = currentTs;
+		}
+	}
+	else {
+		if (times->lastTsIns < currentTs) {
+			times->lastTsIns = currentTs;
+		}
+	}
+}
 
-#ifdef DO_STATS
-	pages->num_marks++;
-#endif
-	if ((pages->clear_all) || ((pages->current_size > CLEAN_THRESHOLD) && ((currentTs - pages->last_cleared) > (CLEAN_THRESHOLD*2)))) {
-		//fprintf(stderr, "clear all size before %u curr ts %u collect ts %u\n", pages->current_size, currentTs, collectTs);
-		clear_buffer(pages, collectTs, currentTs);
-        pages->last_cleared = currentTs;
-		//fprintf(stderr, "clear all size after %u\n", pages->current_size);
+//the timestamps of a page just added to the table
+static inline void set_page_times(page_times_t* times, EpochTsVal currentTs, int isRemove) {
+	if (isRemove) {
+		times->lastTsAccess = currentTs;
+		times->lastTsIns = 0;
 	}
+	else {
+		times->lastTsAccess = 0;
+		times->lastTsIns = currentTs;
+	}
+}
+
+void mark_page(active_page_table_t* pages, void* ptr,  int allocation_size, EpochTsVal currentTs, EpochTsVal collectTs, int isRemove) {
+	page_index_t* index = pages->index;
+
+	nv_stats()->page_marks++;
 
 	void * address = ptr;
 	if (address == NULL) {
 		address = GetNextNodeAddress(allocation_size);
 	}
 
-	void* page = get_page_start_address(address);
-
-	size_t i;
+	void* page = get_page_start_address(pages, address);
 
-    size_t first_empty = SIZE_MAX;
+	//consecutive marks mostly hit the same page: no search, no clean up, and nothing to persist
+	size_t m;
+	for (m = 0; m < PAGE_MRU_SIZE; m++) {
+		if (index->mru[m].page == page) {
+			page_mru_entry_t hit = index->mru[m];
+			if (m > 0) {
+				memmove(&index->mru[1], &index->mru[0], m * sizeof(page_mru_entry_t));
+				index->mru[0] = hit;
+			}
+			nv_thread_stats_t* stats = nv_stats();
+			stats->page_hits++;
+			stats->page_mru_hits++;
+			touch_page(page_times(pages, hit.position), currentTs, isRemove);
+			return;
+		}
+	}
 
+	//the clean up is spread over the following marks, CLEAN_STEP entries at a time
+	if (pages->clear_all) {
+		clear_buffer(pages, collectTs, currentTs);
+        pages->last_cleared = currentTs;
+	}
+	else if (index->clean_cursor != SIZE_MAX) {
+		clean_step(pages, CLEAN_STEP);
+	}
+	else if ((pages->current_size > CLEAN_THRESHOLD) && ((currentTs - pages->last_cleared) > (CLEAN_THRESHOLD*2))) {
+		//fprintf(stderr, "clear all size before %u curr ts %u collect ts %u\n", pages->current_size, currentTs, collectTs);
+		clean_start(pages, collectTs, currentTs);
+        pages->last_cleared = currentTs;
+		clean_step(pages, CLEAN_STEP);
+	}
 
-    for (i = 0; i < pages->last_in_use; i++) {
-			if (pages->pages[i].page == page) {
-				//page already present, nothing to add, can return
-#ifdef DO_STATS
-				pages->hits++;
-#endif
-				if (isRemove) {
-					if (pages->pages[i].lastTsAccess < currentTs) {
-						pages->pages[i].lastTsAccess = currentTs;
-						//no need to persist this, the timestamps are not important for recovery
-					}
-				}
-				else {
-					if (pages->pages[i].lastTsIns < currentTs) {
-						pages->pages[i].lastTsIns = currentTs;
-						//no need to persist this, the timestamps are not important for recovery
-					}
-				}
-				return;
-			}
+	size_t i = page_index_find(pages, page);
 
-			if (pages->pages[i].page == NULL) {
-				if (first_empty == SIZE_MAX) first_empty = i;
-			}
+	if (i != SIZE_MAX) {
+		//page already present, nothing to add, can return
+		nv_stats()->page_hits++;
+		touch_page(page_times(pages, i), currentTs, isRemove);
+		page_mru_push(index, page, i);
+		return;
 	}
 
-	if (first_empty != SIZE_MAX){ 
-		pages->pages[first_empty].page = page;
-		if (isRemove) {
-			pages->pages[first_empty].lastTsAccess = currentTs;
-			pages->pages[first_empty].lastTsIns = 0;
-		}
-		else {
-			pages->pages[first_empty].lastTsAccess = 0;
-			pages->pages[first_empty].lastTsIns = currentTs;
-		}
+	size_t first_empty = free_position_take(index);
+	if (first_empty != SIZE_MAX) {
+		void** entry = page_entry(pages, first_empty);
+		*entry = page;
+		set_page_times(page_times(pages, first_empty), currentTs, isRemove);
 		pages->current_size++;
+		page_index_insert(pages, first_empty);
+		page_mru_push(index, page, first_empty);
 		
-		write_data_wait(&(pages->pages[first_empty]), 1);
+		write_data_wait_at(entry, 1, NV_SITE_PAGE_TABLE);
 		return;
 	}
 
 
-	// page has not been found, and no empty entry in the buffer, up to last_in_use, means we need to try to expand our search space
-    size_t twice = pages->last_in_use*2; 
+	// page has not been found, and no empty entry in the buffer, up to last_in_use, means we need to try to expand our search space:
+	// first within the first segment, then by linking one more segment
+    size_t old = pages->last_in_use;
+    size_t grown;
 
-    if (twice >= MAX_NUM_PAGES) {
-        fprintf(stderr, "PAGE_BUFFER_SIZE_EXCEEDED!\n");
-        //fprintf(stderr, "%lu %lu\n", currentTs, collectTs);
-        return;
+    if (old < SEGMENT_PAGES) {
+        grown = (old * 2 < SEGMENT_PAGES) ? old * 2 : SEGMENT_PAGES;
+    }
+    else {
+        if (add_segment(pages) == NULL) {
+            fprintf(stderr, "PAGE_BUFFER_SIZE_EXCEEDED!\n");
+            return;
+        }
+        grown = old + SEGMENT_PAGES;
     }
 
-    size_t old = pages->last_in_use;
-
-    pages->last_in_use = twice;
-    write_data_wait(pages,1); //need to make sure this is persisted before writing after the marker
+    pages->last_in_use = grown;
+    write_data_wait_at(pages, 1, NV_SITE_PAGE_TABLE); //need to make sure this is persisted before writing after the marker
 
-    assert(pages->pages[old].page == NULL); //we just expanded; this means the newly enabled page entries should be null
+    void** entry = page_entry(pages, old);
+    assert(*entry == NULL); //we just expanded; this means the newly enabled page entries should be null
 
-	pages->pages[old].page = page;
-	if (isRemove) {
-		pages->pages[old].lastTsAccess = currentTs;
-		pages->pages[old].lastTsIns = 0;
-	}
-	else {
-		pages->pages[old].lastTsAccess = 0;
-		pages->pages[old].lastTsIns = currentTs;
-	}
+	*entry = page;
+	set_page_times(page_times(pages, old), currentTs, isRemove);
 
-	write_data_nowait(&(pages->pages[old]), 1);
+	write_data_nowait_at(entry, 1, NV_SITE_PAGE_TABLE);
 
-	wait_writes();
+	wait_writes_at(NV_SITE_PAGE_TABLE);
 
 	pages->current_size++;
+	page_index_insert(pages, old);
+	page_mru_push(index, page, old);
+
+	//the rest of the newly enabled entries are empty
+	for (i = old + 1; i < grown; i++) {
+		free_position_set(index, i);
+	}
 
 }
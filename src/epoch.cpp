@@ -6,6 +6,13 @@ static union {
 	UINT8 pad[EPOCH_CACHE_LINE_SIZE];
 } EpochThreadList;
 
+// Threads scanning the pages on recovery, 0 for one per online cpu.
+static UINT32 recoveryThreads = 0;
+
+// Link cache and page size of the threads' active page tables.
+linkcache_t* link_flush_buffer = NULL;
+size_t active_page_size = PAGE_SIZE;
+
 
 
 // Epoch stats names.
@@ -25,11 +32,13 @@ void FreeUsedGenerations(EpochThreadData *epoch);
 //
 
 void EpochGlobalInit() {
+	nv_memory_init();
 	EpochThreadList.head = NULL;
 	link_flush_buffer = NULL;
 }
 
 void EpochGlobalInit(linkcache_t* buffer_ptr) {
+	nv_memory_init();
 	EpochThreadList.head = NULL;
 	link_flush_buffer = buffer_ptr;
 }
@@ -39,6 +48,10 @@ void EpochSetFlushBuffer(linkcache_t* buffer_ptr) {
 	link_flush_buffer = buffer_ptr;
 }
 
+void EpochSetPageSize(size_t page_size) {
+	active_page_size = page_size;
+}
+
 void* GetOpaquePageBuffer(EpochThread opaqueEpoch) {
 	EpochThreadData *epoch = (EpochThreadData *)opaqueEpoch;
 	return (void*)epoch->active_page_table;
@@ -63,13 +76,257 @@ void EpochGlobalShutdown() {
 		// done before at ThreadShutdown time.
 		EpochFreeAligned(prev);
 	}
+
+#ifndef ESTIMATE_RECOVERY
+	// the tables of all the threads are destroyed by now
+	active_page_pool_close(1);
+#else
+	// the tables are kept for the recovery of the next run
+	active_page_pool_close(0);
+#endif
+}
+
+void EpochSetRecoveryThreads(UINT32 numThreads) {
+	recoveryThreads = numThreads;
+}
+
+// Pages marked in the tables of the previous run.
+struct EpochRecoveredPage {
+	UINT_PTR start;
+	UINT_PTR end;
+};
+
+struct EpochRecoveredPages {
+	EpochRecoveredPage *pages;
+	size_t count;
+	size_t capacity;
+};
+
+static void EpochCollectPage(void *page, size_t pageSize, UINT32 threadId, void *context) {
+	EpochRecoveredPages *recovered = (EpochRecoveredPages *)context;
+
+	if(recovered->count == recovered->capacity) {
+		recovered->capacity = recovered->capacity ? recovered->capacity * 2 : 1024;
+		recovered->pages = (EpochRecoveredPage *)realloc(recovered->pages,
+			recovered->capacity * sizeof(EpochRecoveredPage));
+	}
+	recovered->pages[recovered->count].start = (UINT_PTR)page;
+	recovered->pages[recovered->count].end = (UINT_PTR)page + pageSize;
+	recovered->count++;
+}
+
+static int EpochComparePages(const void *a, const void *b) {
+	UINT_PTR x = ((const EpochRecoveredPage *)a)->start;
+	UINT_PTR y = ((const EpochRecoveredPage *)b)->start;
+	return (x > y) - (x < y);
+}
+
+struct EpochRecoveryJob;
+
+// One recovery worker. Its partition of the pages is claimed a few
+// pages at a time, by the worker itself and then by the workers that
+// are done with their own partition.
+struct EpochRecoveryWorker {
+	union {
+		volatile UINT64 next;
+		UINT8 pad_next[EPOCH_CACHE_LINE_SIZE];
+	};
+
+	UINT64 end;
+
+	UINT32 id;
+	pthread_t thread;
+	EpochRecoveryJob *job;
+
+	UINT64 liveNodes;
+	UINT64 freedNodes;
+};
+
+struct EpochRecoveryJob {
+	EpochRecoveredPage *pages;
+	size_t nodeSize;
+	EpochReachableFun reachable;
+	void *context;
+	EpochRecoveryWorker *workers;
+	UINT32 numWorkers;
+};
+
+static bool EpochRecoveryClaim(EpochRecoveryWorker *partition, UINT64 *first, UINT64 *last) {
+	if(partition->next >= partition->end) {
+		return false;
+	}
+
+	UINT64 claimed = __sync_fetch_and_add(&partition->next, EPOCH_RECOVERY_CLAIM);
+	if(claimed >= partition->end) {
+		return false;
+	}
+
+	*first = claimed;
+	*last = claimed + EPOCH_RECOVERY_CLAIM < partition->end ?
+		claimed + EPOCH_RECOVERY_CLAIM : partition->end;
+	return true;
+}
+
+static void EpochRecoveryFreeBatch(EpochRecoveryWorker *worker, void **batch, ULONG count) {
+	for(ULONG i = 0;i < count;i++) {
+		FreeNode(batch[i]);
+	}
+	worker->freedNodes += count;
+}
+
+// scans the pages claimed by worker and frees its unreachable nodes
+static void EpochRecoveryScan(EpochRecoveryWorker *worker) {
+	EpochRecoveryJob *job = worker->job;
+
+	// unreachable nodes are freed in batches, through the cache of this thread
+	void *batch[EPOCH_RECOVERY_FREE_BATCH];
+	ULONG batched = 0;
+
+	// own partition first, then steal from the others
+	for(UINT32 i = 0;i < job->numWorkers;i++) {
+		EpochRecoveryWorker *partition = &job->workers[(worker->id + i) % job->numWorkers];
+		UINT64 first, last;
+
+		while(EpochRecoveryClaim(partition, &first, &last)) {
+			for(UINT64 p = first;p < last;p++) {
+				UINT_PTR end = job->pages[p].end;
+
+				for(UINT_PTR node = job->pages[p].start;node + job->nodeSize <= end;node += job->nodeSize) {
+					if(DSNodeMemoryIsFree((void *)node, job->nodeSize)) {
+						continue;
+					}
+					worker->liveNodes++;
+
+					if(!job->reachable((void *)node, job->context)) {
+						batch[batched++] = (void *)node;
+						if(batched == EPOCH_RECOVERY_FREE_BATCH) {
+							EpochRecoveryFreeBatch(worker, batch, batched);
+							batched = 0;
+						}
+					}
+				}
+			}
+		}
+	}
+	EpochRecoveryFreeBatch(worker, batch, batched);
+}
+
+static void *EpochRecoveryRun(void *arg) {
+	EpochRecoveryScan((EpochRecoveryWorker *)arg);
+
+	// the frees are not left in the cache of an exiting thread
+	FlushThread();
+	return NULL;
+}
+
+int EpochRecover(size_t nodeSize, EpochReachableFun reachable, void *context,
+		EpochRecoveryStats *stats) {
+	struct timespec begin, end;
+	clock_gettime(CLOCK_MONOTONIC, &begin);
+
+	memset(stats, 0, sizeof(*stats));
+
+	int tables = active_page_pool_open();
+	if(tables < 0) {
+		return -1;
+	}
+	stats->tables = tables;
+
+	EpochRecoveredPages recovered = {NULL, 0, 0};
+	stats->pages = active_page_pool_for_each_page(EpochCollectPage, &recovered);
+
+	// the same page can be marked by several threads, and pages of tables
+	// with different granularities can overlap: overlapping pages are merged,
+	// so that each address is scanned once
+	qsort(recovered.pages, recovered.count, sizeof(EpochRecoveredPage), EpochComparePages);
+
+	size_t numPages = 0;
+	for(size_t i = 0;i < recovered.count;i++) {
+		if(numPages > 0 && recovered.pages[i].start < recovered.pages[numPages - 1].end) {
+			if(recovered.pages[i].end > recovered.pages[numPages - 1].end) {
+				recovered.pages[numPages - 1].end = recovered.pages[i].end;
+			}
+			continue;
+		}
+		recovered.pages[numPages++] = recovered.pages[i];
+	}
+
+	UINT32 numWorkers = recoveryThreads;
+	if(numWorkers == 0) {
+		numWorkers = sysconf(_SC_NPROCESSORS_ONLN);
+	}
+	if(numWorkers == 0) {
+		numWorkers = 1;
+	}
+	stats->workers = numWorkers;
+
+	EpochRecoveryJob job;
+	job.pages = recovered.pages;
+	job.nodeSize = nodeSize;
+	job.reachable = reachable;
+	job.context = context;
+	job.numWorkers = numWorkers;
+	job.workers = (EpochRecoveryWorker *)EpochCacheAlignedCacheSizeAlloc(
+		sizeof(EpochRecoveryWorker) * numWorkers);
+
+	for(UINT32 i = 0;i < numWorkers;i++) {
+		EpochRecoveryWorker *worker = &job.workers[i];
+		worker->next = numPages * i / numWorkers;
+		worker->end = numPages * (i + 1) / numWorkers;
+		worker->id = i;
+		worker->job = &job;
+		worker->liveNodes = 0;
+		worker->freedNodes = 0;
+	}
+
+	for(UINT32 i = 0;i < numWorkers;i++) {
+		int rc = pthread_create(&job.workers[i].thread, NULL, EpochRecoveryRun, &job.workers[i]);
+		if(rc != 0) {
+			// the partition is stolen by the other workers, or run here
+			printf("ERROR; return code from pthread_create() is %d\n", rc);
+			job.workers[i].thread = pthread_self();
+		}
+	}
+
+	for(UINT32 i = 0;i < numWorkers;i++) {
+		if(pthread_equal(job.workers[i].thread, pthread_self())) {
+			continue;
+		}
+		pthread_join(job.workers[i].thread, NULL);
+	}
+
+	for(UINT32 i = 0;i < numWorkers;i++) {
+		// only left by workers that could not be started; scanned here,
+		// without touching the cache of the calling thread
+		if(job.workers[i].next < job.workers[i].end) {
+			EpochRecoveryScan(&job.workers[i]);
+		}
+		stats->liveNodes += job.workers[i].liveNodes;
+		stats->freedNodes += job.workers[i].freedNodes;
+	}
+
+	EpochFreeAligned(job.workers);
+	free(recovered.pages);
+
+	// the pool is reused by the tables of the new threads
+	active_page_pool_free_tables();
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	stats->timeUs = (end.tv_sec - begin.tv_sec) * 1000000ULL
+		+ (end.tv_nsec - begin.tv_nsec) / 1000;
+	return 0;
 }
 
 // initialize and cleanup epoch-related thread data
 EpochThread EpochThreadInit(UINT32 id) {
 	EpochThreadData *epoch = (EpochThreadData *)EpochCacheAlignedCacheSizeAlloc(
 			sizeof(EpochThreadData));
-	epoch->Init(id);
+	if (!epoch->Init(id)) {
+		fprintf(stderr, "could not allocate the active page table of thread %u\n", id);
+		epoch->Uninit();
+		EpochFreeAligned(epoch);
+		return NULL;
+	}
 
 	// Now link the new epoch thread at the end of the list. We must make
 	// sure that the positions of epochs in the list are never changed
@@ -388,8 +645,9 @@ void EpochChangeGeneration(EpochThreadData *epoch) {
 
 	// 3. See if we can free something from used generations.
 #ifdef BUFFERING_ON
-	//fprintf(stderr, "chaning generations\n");
-	cache_wb_all_buckets(link_flush_buffer);
+	// Only the links of this thread need to be persistent before its
+	// garbage is freed.
+	cache_wb_touched_buckets(link_flush_buffer, &epoch->touched_buckets);
 #endif
 
     //fprintf(stderr, "after coll %lu %lu\n", (*currentVectorTs)[0], (*currentVectorTs)[1]);
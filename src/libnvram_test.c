@@ -0,0 +1,201 @@
+#include <assert.h>
+#include <getopt.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "epoch.h"
+
+/*
+ *  Recovery benchmark: fills the active page tables of a number of
+ *  threads, drops them as a crash would, and measures EpochRecover
+ *  for growing table occupancies and numbers of recovery threads
+ */
+
+size_t node_size = 64;
+int unreachable_percent = 50;
+
+/*
+ *  Nodes are unreachable depending on their address only, so that
+ *  the frees done by the recovery are known in advance
+ */
+
+static int reachable(void* node, void* context) {
+  UINT64 hash = ((UINT_PTR)node / node_size) * 0x9E3779B97F4A7C15ULL;
+  return (int)((hash >> 32) % 100) >= unreachable_percent;
+}
+
+/*
+ *  Allocate nodes and mark their pages until each table holds
+ *  num_pages pages; returns the number of nodes
+ */
+
+static size_t populate(int num_tables, size_t num_pages, void*** nodes, size_t* unreachable) {
+  size_t count = 0, capacity = 1024;
+  *nodes = (void**)malloc(capacity * sizeof(void*));
+  *unreachable = 0;
+
+  int t;
+  for (t = 0; t < num_tables; t++) {
+    active_page_table_t* table = create_active_page_table(t);
+    assert(table != NULL);
+
+    while (table->current_size < num_pages) {
+      void* node = AllocNode(node_size);
+      mark_page(table, node, node_size, 1, 0, 0);
+
+      if (count == capacity) {
+	capacity *= 2;
+	*nodes = (void**)realloc(*nodes, capacity * sizeof(void*));
+      }
+      (*nodes)[count++] = node;
+      if (!reachable(node, NULL)) {
+	(*unreachable)++;
+      }
+    }
+
+    // crash: the volatile part of the table is lost
+    forget_active_page_table(table);
+  }
+
+  // the pool is kept
+  active_page_pool_close(0);
+  return count;
+}
+
+int main(int argc, char **argv) {
+
+  struct option long_options[] = {
+    // These options don't set a flag
+    {"help",                      no_argument,       NULL, 'h'},
+    {"num-tables",                required_argument, NULL, 'n'},
+    {"pages",                     required_argument, NULL, 'p'},
+    {"recovery-threads",          required_argument, NULL, 'w'},
+    {"node-size",                 required_argument, NULL, 's'},
+    {"unreachable",               required_argument, NULL, 'u'},
+    {"dir",                       required_argument, NULL, 'd'},
+    {NULL, 0, NULL, 0}
+  };
+
+  int num_tables = 16;
+  size_t max_pages = 1024;
+  int max_threads = sysconf(_SC_NPROCESSORS_ONLN);
+  const char* dir = NULL;
+
+  int i, c;
+  int failed = 0;
+  while(1)
+    {
+      i = 0;
+      c = getopt_long(argc, argv, "hn:p:w:s:u:d:", long_options, &i);
+
+      if(c == -1)
+	break;
+
+      if(c == 0 && long_options[i].flag == 0)
+	c = long_options[i].val;
+
+      switch(c)
+	{
+	case 0:
+	  /* Flag is automatically set */
+	  break;
+	case 'h':
+	  printf("libnvram_test -- recovery benchmark \n"
+		 "Usage:\n"
+		 "  ./libnvram_test [options...]\n"
+		 "\n"
+		 "Options:\n"
+		 "  -h, --help\n"
+		 "        Print this message\n"
+		 "  -n, --num-tables <int>\n"
+		 "        Number of threads whose active page tables are recovered\n"
+		 "  -p, --pages <int>\n"
+		 "        Largest number of pages per table; occupancies from an eighth of it are measured\n"
+		 "  -w, --recovery-threads <int>\n"
+		 "        Largest number of recovery threads; powers of two up to it are measured\n"
+		 "  -s, --node-size <int>\n"
+		 "        Size of the nodes in bytes\n"
+		 "  -u, --unreachable <int>\n"
+		 "        Percentage of the nodes that are unreachable, and freed by the recovery\n"
+		 "  -d, --dir <string>\n"
+		 "        Directory of the pool of the active page tables\n"
+		 );
+	  exit(0);
+	case 'n':
+	  num_tables = atoi(optarg);
+	  break;
+	case 'p':
+	  max_pages = atol(optarg);
+	  break;
+	case 'w':
+	  max_threads = atoi(optarg);
+	  break;
+	case 's':
+	  node_size = atol(optarg);
+	  break;
+	case 'u':
+	  unreachable_percent = atoi(optarg);
+	  break;
+	case 'd':
+	  dir = optarg;
+	  break;
+	case '?':
+	  printf("Use -h or --help for help\n");
+	  exit(0);
+	default:
+	  exit(1);
+	}
+    }
+
+  if (max_threads < 1) {
+    max_threads = 1;
+  }
+
+  EpochGlobalInit();
+  if (dir != NULL) {
+    active_page_pool_configure(dir, 0);
+  }
+
+  size_t num_pages = max_pages / 8 > 0 ? max_pages / 8 : 1;
+  for (; num_pages <= max_pages; num_pages *= 2) {
+    int threads = 1;
+    while (1) {
+      void** nodes;
+      size_t unreachable;
+      size_t num_nodes = populate(num_tables, num_pages, &nodes, &unreachable);
+
+      EpochRecoveryStats stats;
+      EpochSetRecoveryThreads(threads);
+      if (EpochRecover(node_size, reachable, NULL, &stats) != 0) {
+	printf("Nothing to recover.\n");
+	exit(1);
+      }
+
+      printf("%d tables x %lu pages, %lu recovery threads: %lu pages scanned, %lu live nodes, %lu freed in %lu us\n",
+	     num_tables, num_pages, stats.workers, stats.pages, stats.liveNodes, stats.freedNodes, stats.timeUs);
+      if (stats.liveNodes != num_nodes || stats.freedNodes != unreachable) {
+	printf("Wrong node count: %lu live (expected %lu), %lu freed (expected %lu).\n",
+	       stats.liveNodes, num_nodes, stats.freedNodes, unreachable);
+	failed = 1;
+      }
+
+      size_t n;
+      for (n = 0; n < num_nodes; n++) {
+	if (reachable(nodes[n], NULL)) {
+	  FreeNode(nodes[n]);
+	}
+      }
+      free(nodes);
+
+      if (threads >= max_threads) {
+	break;
+      }
+      threads = threads * 2 < max_threads ? threads * 2 : max_threads;
+    }
+  }
+
+  EpochGlobalShutdown();
+  return failed;
+}
@@ -1,129 +1,488 @@
+#include <time.h>
+#include <sched.h>
+
 #include "link-cache.h"
 
-#ifdef DO_PROFILE
-extern __thread uint64_t inserts;
-extern __thread uint64_t removes;
-#ifdef TSX_ENABLED
-extern __thread uint64_t inserts_tsx;
-#endif
-#endif
+void cache_backoff_default_config(backoff_config_t* config) {
+	config->min_pause = DEFAULT_BACKOFF_MIN_PAUSE;
+	config->max_pause = DEFAULT_BACKOFF_MAX_PAUSE;
+}
 
-linkcache_t* cache_create() {
-	int i;
+linkcache_t* cache_create(UINT32 num_buckets) {
+	return cache_create_with_backoff(num_buckets, NULL);
+}
 
-#ifdef DO_PROFILE
-    inserts = 0;
-    removes = 0;
-#ifdef TSX_ENABLED
-    inserts_tsx = 0;
-#endif
-#endif
+linkcache_t* cache_create_with_backoff(UINT32 num_buckets, const backoff_config_t* backoff) {
+	UINT32 i;
+
+	nv_memory_init();
+
+	if (num_buckets == 0) {
+		num_buckets = DEFAULT_NUM_BUCKETS;
+	}
+	if (num_buckets > MAX_NUM_BUCKETS) {
+		//the next power of two does not fit in 32 bits
+		fprintf(stderr, "%u buckets requested, using %u\n", num_buckets, MAX_NUM_BUCKETS);
+		num_buckets = MAX_NUM_BUCKETS;
+	}
+	UINT32 shift = 0;
+	while (((UINT32)1 << shift) < num_buckets) {
+		shift++;
+	}
+	num_buckets = (UINT32)1 << shift;
 
 	linkcache_t* new_cache = (linkcache_t*)memalign(CACHE_LINE_SIZE, sizeof(linkcache_t)); //this can be allocated in volatile memory
 
-	for (i = 0; i < NUM_BUCKETS; i++) {
-		new_cache->buckets[i] = (bucket_t*)memalign(CACHE_LINE_SIZE, sizeof(bucket_t));
-		new_cache->buckets[i]->header.all = 0;
+	new_cache->num_buckets = num_buckets;
+	new_cache->bucket_mask = num_buckets - 1;
+	new_cache->bucket_shift = shift;
+	new_cache->num_stash_buckets = num_buckets / STASH_BUCKET_RATIO;
+	if (new_cache->num_stash_buckets < MIN_NUM_STASH_BUCKETS) {
+		new_cache->num_stash_buckets = MIN_NUM_STASH_BUCKETS;
+	}
+	new_cache->flusher_running = 0;
+	if (backoff != NULL) {
+		new_cache->backoff = *backoff;
+	}
+	else {
+		cache_backoff_default_config(&new_cache->backoff);
+	}
+	if (new_cache->backoff.min_pause == 0) {
+		new_cache->backoff.min_pause = 1;
+	}
+	if (new_cache->backoff.max_pause < new_cache->backoff.min_pause) {
+		new_cache->backoff.max_pause = new_cache->backoff.min_pause;
+	}
+	new_cache->buckets = (bucket_t*)memalign(CACHE_LINE_SIZE, (num_buckets + new_cache->num_stash_buckets) * sizeof(bucket_t));
+
+	for (i = 0; i < num_buckets + new_cache->num_stash_buckets; i++) {
+		new_cache->buckets[i].header.all = 0;
+		new_cache->buckets[i].flush_seq = 0;
+	}
+
+	new_cache->num_dirty_shards = (num_buckets + new_cache->num_stash_buckets + BUCKETS_PER_DIRTY_SHARD - 1) / BUCKETS_PER_DIRTY_SHARD;
+	new_cache->dirty = (dirty_shard_t*)memalign(CACHE_LINE_SIZE, new_cache->num_dirty_shards * sizeof(dirty_shard_t));
+	for (i = 0; i < new_cache->num_dirty_shards; i++) {
+		new_cache->dirty[i].buckets = 0;
 	}
 
 	_mm_sfence();
 	return new_cache;
 }
 
-void cache_destroy(linkcache_t* cache) {
-	int i;
+/*
+	called after a failed CAS on the header of the bucket: pause, and double the next pause (up to the configured maximum)
+*/
+static inline void backoff(linkcache_t* cache, UINT32* pause) {
+	UINT32 i;
 
-	for (i = 0; i < NUM_BUCKETS; i++) {
-		free(cache->buckets[i]);
+	//counted per thread, so that contended buckets do not get an extra store on their header's line
+	nv_stats()->cache_cas_failures++;
+	for (i = 0; i < *pause; i++) {
+		_mm_pause();
 	}
+	*pause = (*pause * 2 < cache->backoff.max_pause) ? *pause * 2 : cache->backoff.max_pause;
+}
+
+void cache_destroy(linkcache_t* cache) {
+	cache_stop_flusher(cache);
+	free(cache->dirty);
+	free(cache->buckets);
 	free(cache);
 }
 
 
 /*
-	make sure everything is flushed
+	wait until a write-back of the bucket which started after flush_seq was read as seq has completed,
+	doing it ourselves if the bucket is free
+*/
+void bucket_wb_after(linkcache_t* cache, UINT32 bucket_num, UINT32 seq) {
+	bucket_t* bucket = &cache->buckets[bucket_num];
+
+	//the write-back in progress when seq was read completes as seq + 1, and the ones after it started later
+	while ((int32_t)(bucket->flush_seq - (seq + 2)) < 0) {
+		if (((int32_t)(bucket->flush_seq - (seq + 1)) >= 0) && (bucket_wb(cache, bucket_num))) {
+			return;
+		}
+		_mm_pause();
+	}
+}
+
+/*
+	wait until the write-back of the bucket in progress when flush_seq was read as seq, if any, has completed
+*/
+static void bucket_wb_wait(linkcache_t* cache, UINT32 bucket_num, UINT32 seq) {
+	bucket_t* bucket = &cache->buckets[bucket_num];
+
+	//flush_seq is incremented before the lock is released
+	while ((bucket->flush_seq == seq) && bucket->header.write_back_lock) {
+		_mm_pause();
+	}
+}
+
+/*
+	buckets locked by bucket_wb_start; the lines of their busy entries are deferred in the thread's flush set,
+	which writes each distinct line back once, with a single fence for all the buckets
+*/
+#define WB_BATCH_BUCKETS 32
+
+typedef struct wb_batch_t {
+	UINT32 num_buckets;
+	UINT32 buckets[WB_BATCH_BUCKETS];
+} wb_batch_t;
+
+static int bucket_wb_start(linkcache_t* cache, unsigned bucket_num, wb_batch_t* batch);
+static void wb_batch_complete(linkcache_t* cache, wb_batch_t* batch);
+
+//starts the write-back of the bucket as part of the batch, completing the batch once it is full
+static int wb_batch_add(linkcache_t* cache, unsigned bucket_num, wb_batch_t* batch) {
+	if (!bucket_wb_start(cache, bucket_num, batch)) {
+		return 0;
+	}
+	if (batch->num_buckets == WB_BATCH_BUCKETS) {
+		wb_batch_complete(cache, batch);
+	}
+	return 1;
+}
+
+#define WB_ALL_MAX_DEFERRED 64
+
+/*
+	buckets cache_wb_all_buckets found locked by another thread: those with busy entries need a write-back that started later,
+	while for the others the write-back in progress (which freed their entries) is enough
+*/
+static void wb_all_wait_deferred(linkcache_t* cache, UINT32 buckets[], UINT32 seqs[], UINT8 busy[], UINT32 count) {
+	UINT32 j;
+
+	for (j = 0; j < count; j++) {
+		if (busy[j]) {
+			bucket_wb_after(cache, buckets[j], seqs[j]);
+		}
+		else {
+			bucket_wb_wait(cache, buckets[j], seqs[j]);
+		}
+	}
+}
+
+/*
+	make sure everything is flushed: one pass over the buckets, writing back the free ones,
+	then waiting only for the buckets that other threads were writing back at the time
 */
 void cache_wb_all_buckets(linkcache_t* cache) {
-	// is there a cheaper way of doing this?
-	int i;
-	char flushed[NUM_BUCKETS];
-	for (i = 0; i < NUM_BUCKETS; i++) {
-		flushed[i] = 0;
-	}
-	int total_flushed = 0;
-	while (total_flushed < NUM_BUCKETS) {
-		for (i = 0; i < NUM_BUCKETS; i++) {
-			if (flushed[i] == 0) {
-				if (bucket_wb(cache, i)) {
-					flushed[i] = 1;
-					total_flushed++;
-				}
+	UINT32 i, shard;
+	UINT64 dirty;
+	UINT32 deferred_bucket[WB_ALL_MAX_DEFERRED];
+	UINT32 deferred_seq[WB_ALL_MAX_DEFERRED];
+	UINT8 deferred_busy[WB_ALL_MAX_DEFERRED];
+	UINT32 num_deferred = 0;
+	wb_batch_t batch;
+
+	batch.num_buckets = 0;
+
+	//only the buckets with busy entries are visited
+	for (shard = 0; shard < cache->num_dirty_shards; shard++) {
+	for (dirty = cache->dirty[shard].buckets; dirty != 0; dirty &= dirty - 1) {
+		i = shard * BUCKETS_PER_DIRTY_SHARD + __builtin_ctzll(dirty);
+		bucket_t* bucket = &cache->buckets[i];
+		UINT32 seq = bucket->flush_seq;
+		UINT8 busy = !no_completed_entries(bucket->header.local_flags);
+		if (!busy) {
+			if (!bucket->header.write_back_lock) {
+				//nothing to write back
+				continue;
 			}
+			//the entries may have been freed by a write-back which has not fenced yet: wait for it below
 		}
-		_mm_pause();
+		else if (wb_batch_add(cache, i, &batch)) {
+			continue;
+		}
+		if (num_deferred == WB_ALL_MAX_DEFERRED) {
+			//do not hold the locks of the batch while waiting for other threads
+			wb_batch_complete(cache, &batch);
+			wb_all_wait_deferred(cache, deferred_bucket, deferred_seq, deferred_busy, num_deferred);
+			num_deferred = 0;
+		}
+		deferred_bucket[num_deferred] = i;
+		deferred_seq[num_deferred] = seq;
+		deferred_busy[num_deferred] = busy;
+		num_deferred++;
+	}
 	}
+	wb_batch_complete(cache, &batch);
+
+	wb_all_wait_deferred(cache, deferred_bucket, deferred_seq, deferred_busy, num_deferred);
 }
 
-int bucket_wb(linkcache_t* cache, int bucket_num) {
-	int i;
-	UINT16 state, new_state;
-	UINT16 already_flushed = 0;
+/*
+	steps 1-4 of a write-back: lock the bucket, defer the write-backs of its busy entries and free the entries;
+	returns 0 if someone else is already flushing the bucket
+*/
+static int bucket_wb_start(linkcache_t* cache, unsigned bucket_num, wb_batch_t* batch) {
+	bucket_t* current_bucket = &cache->buckets[bucket_num];
+	UINT32 state, new_state;
+	UINT32 busy, to_flush;
+	UINT32 already_flushed = 0;
+	UINT32 pause = cache->backoff.min_pause;
 
-	bucket_t* current_bucket = cache->buckets[bucket_num];
 	//if someone else flushing, return failure
 	if (current_bucket->header.write_back_lock) {
 		return 0;
 	}
 	//Step 1: try acquire the flush lock (contention should be unlikely for this CAS, so the acquisition should ususally succeed)
-	if (CAS_U16((volatile short*)&current_bucket->header.write_back_lock, 0, 1) != 0) {
+	if (CAS_U32(&current_bucket->header.write_back_lock, 0, 1) != 0) {
 		return 0;
 	}
 
-#ifdef DO_PROFILE
-      uint64_t current_removes;
-#endif
-	do {
-#ifdef DO_PROFILE
-        current_removes = 0;
-#endif
-
+	while (1) {
 		//Step 2: get the bitmap of the state of the addresses in the bucket
 		state = current_bucket->header.local_flags;
+		busy = busy_entries(state);
 
-		//Step 3: flush those which had the flags set to busy (just once)
-		for (i = 0; i < NUM_ENTRIES_PER_BUCKET; i++) {
-			if (is_busy(state, i) && (is_free(already_flushed, i))) {
-				write_data_nowait((void*)current_bucket->addresses[i], 1);
-			}
+		//Step 3: defer the write-backs of those which had the flags set to busy (just once)
+		for (to_flush = busy & ~already_flushed; to_flush != 0; to_flush &= to_flush - 1) {
+			write_data_deferred_at((void*)current_bucket->addresses[entry_index(to_flush)], 1, NV_SITE_LINK_CACHE);
 		}
+		already_flushed |= busy;
 
-		//Step 4: try to reset all the flags of the entries which have been flushed
-		new_state = state;
-		for (i = 0; i < NUM_ENTRIES_PER_BUCKET; i++) {
-			if (is_busy(state, i)) {
-				new_state = mark_free(new_state, i);
-#ifdef DO_PROFILE
-                current_removes++;
-#endif
-				already_flushed = mark_busy(already_flushed, i);
-			}
+		//Step 4: try to reset all the flags of the entries which have been flushed (busy is 10, so clearing the high bit frees the entry)
+		new_state = state & ~busy;
+		if (CAS_U32(&current_bucket->header.local_flags, state, new_state) == state) {
+			break;
 		}
+		backoff(cache, &pause);
+	}
 
-	} while (CAS_U16((volatile short*)&current_bucket->header.local_flags, state, new_state) != state);
+	batch->buckets[batch->num_buckets++] = bucket_num;
+	nv_stats()->cache_removes += __builtin_popcount(busy);
+	return 1;
+}
 
-#ifdef DO_PROFILE
-     removes+=current_removes;
-#endif
-	//Step 5: make sure the write-backs which I have issued are written to persistent memory
-	wait_writes();
+/*
+	step 6 of a write-back, once the lines deferred by bucket_wb_start are persistent
+*/
+static void bucket_wb_finish(linkcache_t* cache, unsigned bucket_num) {
+	bucket_t* current_bucket = &cache->buckets[bucket_num];
 
-	//Step 6: release the flushing lock
+	//Step 6: the freed entries are persistent now: clear the bucket in the dirty summary, unless an entry became busy in the meantime
+	mark_bucket_clean(cache, bucket_num);
+	if (!no_completed_entries(current_bucket->header.local_flags)) {
+		mark_bucket_dirty(cache, bucket_num);
+	}
+	//publish the completion (after the dirty bit is right again, see wait_older_write_back) and release the flushing lock
+	current_bucket->flush_seq++;
 	current_bucket->header.write_back_lock = 0;
 	_mm_sfence();
+}
+
+/*
+	adds the stash bucket of a regular bucket to the batch of its write-back, if the batch has room:
+	the links which overflowed into the stash are written back with the same fence, and the stash keeps room for the next full bucket
+*/
+static void bucket_wb_start_stash(linkcache_t* cache, unsigned bucket_num, wb_batch_t* batch) {
+	if ((bucket_num >= cache->num_buckets) || (batch->num_buckets == WB_BATCH_BUCKETS)) {
+		return;
+	}
+	unsigned stash_num = get_stash_bucket(cache, bucket_num);
+	if (!no_completed_entries(cache->buckets[stash_num].header.local_flags)) {
+		bucket_wb_start(cache, stash_num, batch);
+	}
+}
+
+/*
+	steps 5-6 for every bucket of the batch: one write-back per distinct line, one fence, then release the buckets
+*/
+static void wb_batch_complete(linkcache_t* cache, wb_batch_t* batch) {
+	UINT32 i;
+
+	if (batch->num_buckets == 0) {
+		return;
+	}
+
+	//Step 5: write back the deferred lines of the batch and make sure they are written to persistent memory
+	wait_writes_at(NV_SITE_LINK_CACHE);
+
+	for (i = 0; i < batch->num_buckets; i++) {
+		bucket_wb_finish(cache, batch->buckets[i]);
+	}
+	batch->num_buckets = 0;
+}
 
+int bucket_wb(linkcache_t* cache, int bucket_num) {
+	wb_batch_t batch;
+
+	batch.num_buckets = 0;
+	if (!bucket_wb_start(cache, bucket_num, &batch)) {
+		return 0;
+	}
+	bucket_wb_start_stash(cache, bucket_num, &batch);
+	wb_batch_complete(cache, &batch);
 	return 1;
 }
 
+/*
+	buckets this thread linked into, if it asked for them to be tracked
+*/
+static __thread touched_buckets_t* touched_buckets = NULL;
+
+void cache_track_touched_buckets(touched_buckets_t* touched) {
+	if (touched != NULL) {
+		touched->num_buckets = 0;
+		touched->overflow = 0;
+	}
+	touched_buckets = touched;
+}
+
+//called after an entry of the bucket became busy, so that any write-back starting after flush_seq is read covers it
+static inline void record_touched_bucket(linkcache_t* cache, UINT32 bucket_num) {
+	touched_buckets_t* touched = touched_buckets;
+	UINT32 i;
+
+	if ((touched == NULL) || touched->overflow) {
+		return;
+	}
+	UINT32 seq = cache->buckets[bucket_num].flush_seq;
+	for (i = 0; i < touched->num_buckets; i++) {
+		if (touched->buckets[i] == bucket_num) {
+			//the later write-back covers the earlier links as well
+			touched->seqs[i] = seq;
+			return;
+		}
+	}
+	if (touched->num_buckets == TOUCHED_BUCKETS_MAX) {
+		touched->overflow = 1;
+		return;
+	}
+	touched->buckets[touched->num_buckets] = bucket_num;
+	touched->seqs[touched->num_buckets] = seq;
+	touched->num_buckets++;
+}
+
+/*
+	write back only the buckets in touched, skipping the ones that went through a complete write-back since;
+	falls back to cache_wb_all_buckets if more buckets were touched than could be tracked
+*/
+void cache_wb_touched_buckets(linkcache_t* cache, touched_buckets_t* touched) {
+	UINT32 i, j;
+	UINT32 deferred_bucket[TOUCHED_BUCKETS_MAX];
+	UINT32 deferred_seq[TOUCHED_BUCKETS_MAX];
+	UINT32 num_deferred = 0;
+	wb_batch_t batch;
+
+	if (touched->overflow) {
+		cache_wb_all_buckets(cache);
+		touched->num_buckets = 0;
+		touched->overflow = 0;
+		return;
+	}
+
+	batch.num_buckets = 0;
+	for (i = 0; i < touched->num_buckets; i++) {
+		UINT32 bucket_num = touched->buckets[i];
+		bucket_t* bucket = &cache->buckets[bucket_num];
+		UINT32 seq = bucket->flush_seq;
+		//a write-back started after the link and has completed
+		if ((int32_t)(seq - (touched->seqs[i] + 2)) >= 0) {
+			continue;
+		}
+		if (wb_batch_add(cache, bucket_num, &batch)) {
+			continue;
+		}
+		deferred_bucket[num_deferred] = bucket_num;
+		deferred_seq[num_deferred] = seq;
+		num_deferred++;
+	}
+	wb_batch_complete(cache, &batch);
+
+	for (j = 0; j < num_deferred; j++) {
+		bucket_wb_after(cache, deferred_bucket[j], deferred_seq[j]);
+	}
+	touched->num_buckets = 0;
+}
+
+/*
+	called once entries of the bucket are busy and the bucket is marked dirty, before their targets are unmarked:
+	a write-back which was already running does not cover these entries, and clears the dirty bit for a moment
+	before it completes; readers trust an unmarked target in a clean bucket, so wait for it
+*/
+static inline void wait_older_write_back(linkcache_t* cache, unsigned bucket_num) {
+	bucket_t* bucket = &cache->buckets[bucket_num];
+	UINT32 seq = bucket->flush_seq;
+
+	if (bucket->header.write_back_lock) {
+		bucket_wb_wait(cache, bucket_num, seq);
+	}
+}
+
+#define LINK_BUCKET_FULL -1
+
+/*
+	reserve an entry of the bucket, do the link, and publish the entry;
+	returns 1 on success, 0 if the CAS on the target failed, and LINK_BUCKET_FULL if the bucket has no free entry and could not be written back
+*/
+static int link_in_bucket(linkcache_t* cache, unsigned bucket_num, UINT16 hash, volatile void** target, volatile void* oldvalue, volatile void* value) {
+    UINT32 state;
+	bucket_t* bucket = &cache->buckets[bucket_num];
+	UINT32 pause = cache->backoff.min_pause;
+retry:
+
+	state = bucket->header.local_flags;
+
+	if (no_free_index(state)) {
+		if (!(no_completed_entries(state)) &&  (bucket_wb(cache, bucket_num))) {
+			goto retry;
+		}
+		return LINK_BUCKET_FULL;
+	}
+
+	int i = find_free_index(state);
+
+	UINT32 new_state = state;
+	new_state = mark_pending(new_state, i);
+
+	if (CAS_U32(&bucket->header.local_flags, state, new_state) != state) {
+		backoff(cache, &pause);
+		goto retry;
+	}
+
+
+	bucket->addresses[i] = target; //FIXME is this right ???
+	bucket->hashes[i] = hash;
+
+	if (CAS_PTR((volatile PVOID*)target, (PVOID) oldvalue, (PVOID)mark_ptr_cache((UINT_PTR)value)) != oldvalue) {
+		//abort
+		state = bucket->header.local_flags;
+		new_state = state;
+		new_state = mark_free(new_state, i);
+
+		while (CAS_U32(&bucket->header.local_flags, state, new_state) != state) {
+		    state = bucket->header.local_flags;
+		    new_state = state;
+		    new_state = mark_free(new_state, i);
+			backoff(cache, &pause);
+		}
+		return 0;
+	}
+
+	state = bucket->header.local_flags;
+	new_state = state;
+	new_state = mark_busy(new_state, i);
+
+	while (CAS_U32(&bucket->header.local_flags, state, new_state) != state) {
+	    state = bucket->header.local_flags;
+	    new_state = state;
+	    new_state = mark_busy(new_state, i);
+		backoff(cache, &pause);
+	}
+	mark_bucket_dirty(cache, bucket_num);
+	record_touched_bucket(cache, bucket_num);
+	wait_older_write_back(cache, bucket_num);
+
+	UNUSED PVOID dummy = CAS_PTR((volatile PVOID*)target,(PVOID)mark_ptr_cache((UINT_PTR) value), (PVOID) value);
+
+	nv_stats()->cache_inserts++;
+	return 1;
+
+}
 
 int cache_try_link_and_add(linkcache_t* cache, UINT64 key, volatile void** target, volatile void* oldvalue, volatile void* value) {
 
@@ -135,21 +494,22 @@ int cache_try_link_and_add(linkcache_t* cache, UINT64 key, volatile void** targe
 	/*UNUSED PVOID dummy2 = CAS_PTR((volatile PVOID*)target,(PVOID)mark_ptr_cache((UINT_PTR) value), (PVOID) value);*/
     /*return 1;*/
 	
-	unsigned bucket_num = get_bucket(key);
-	UINT16 hash = get_hash(key);
+	unsigned bucket_num = get_bucket(cache, key);
+	UINT16 hash = get_hash(cache, key);
 
-	bucket_t* bucket = cache->buckets[bucket_num];
 #ifdef TSX_ENABLED
+	bucket_t* bucket = &cache->buckets[bucket_num];
 	//first try to do the linking and insertion through a TSX transaction
 	unsigned int status = _xbegin();
 	if (status == _XBEGIN_STARTED) {
-		UINT16 state = bucket->header.local_flags;
-		if (no_free_index(state)) {
+		UINT32 state = bucket->header.local_flags;
+		//readers rely on the dirty bit being set whenever the bucket has busy entries; a write-back in progress may clear it
+		if (no_free_index(state) || bucket->header.write_back_lock || !is_bucket_dirty(cache, bucket_num)) {
 			_xabort(0);
 		}
 		else {
 			int i = find_free_index(state);
-			UINT16 new_state = state;
+			UINT32 new_state = state;
 			new_state = mark_busy(new_state, i);
 			bucket->header.local_flags = new_state;
 			bucket->addresses[i] = target;
@@ -157,10 +517,10 @@ int cache_try_link_and_add(linkcache_t* cache, UINT64 key, volatile void** targe
 			if (*target == oldvalue) {
 				*target = value;
 				_xend();
-#ifdef DO_PROFILE
-                inserts++;
-                inserts_tsx++;
-#endif
+				record_touched_bucket(cache, bucket_num);
+				nv_thread_stats_t* stats = nv_stats();
+				stats->cache_inserts++;
+				stats->cache_inserts_tsx++;
 				return 1;
 			}
 			else {
@@ -171,107 +531,414 @@ int cache_try_link_and_add(linkcache_t* cache, UINT64 key, volatile void** targe
 	}
 #endif
 	//if we do not manage to to execute the tsx transaction, try through successive CASes
-    UINT16 state;
-retry:
+	int linked = link_in_bucket(cache, bucket_num, hash, target, oldvalue, value);
+	if (linked != LINK_BUCKET_FULL) {
+		return linked;
+	}
 
-	state = bucket->header.local_flags;
+	//the bucket is full, and cannot be written back right now: use the stash bucket instead
+	linked = link_in_bucket(cache, get_stash_bucket(cache, bucket_num), get_stash_hash(key), target, oldvalue, value);
+	if (linked != LINK_BUCKET_FULL) {
+		return linked;
+	}
 
-	if (no_free_index(state)) {
-		if (!(no_completed_entries(state)) &&  (bucket_wb(cache, bucket_num))) {
-			goto retry;
-		}
+	//the stash is full as well: link and persist right away, without going through the cache
+	if (CAS_PTR((volatile PVOID*)target, (PVOID) oldvalue, (PVOID)mark_ptr_cache((UINT_PTR)value)) != oldvalue) {
 		return 0;
 	}
+	write_data_wait_at((void*)target, 1, NV_SITE_LINK_CACHE);
+	UNUSED PVOID dummy = CAS_PTR((volatile PVOID*)target,(PVOID)mark_ptr_cache((UINT_PTR) value), (PVOID) value);
 
-	int i = find_free_index(state);
+	nv_stats()->cache_direct_links++;
+	return 1;
+}
 
-	UINT16 new_state = state;
-	new_state = mark_pending(new_state, i);
+//marks the count lowest free entries of the bucket as pending; returns them (low bit of each), or 0 if there are not enough free entries
+static UINT32 reserve_entries(linkcache_t* cache, bucket_t* bucket, int count) {
+	UINT32 state, free_mask, reserved;
+	UINT32 pause = cache->backoff.min_pause;
+	int k;
 
-	if (CAS_U16((volatile short*)&bucket->header.local_flags, state, new_state) != state) {
-		goto retry;
+	while (1) {
+		state = bucket->header.local_flags;
+		free_mask = free_entries(state);
+		if (__builtin_popcount(free_mask) < count) {
+			return 0;
+		}
+		reserved = 0;
+		for (k = 0; k < count; k++) {
+			reserved |= free_mask & (~free_mask + 1);
+			free_mask &= free_mask - 1;
+		}
+		if (CAS_U32(&bucket->header.local_flags, state, state | reserved) == state) { //free is 00, pending is 01
+			break;
+		}
+		backoff(cache, &pause);
 	}
 
+	return reserved;
+}
 
-	bucket->addresses[i] = target; //FIXME is this right ???
-	bucket->hashes[i] = hash;
+//moves the pending entries in reserved to busy if they are in linked, and to free otherwise
+static void release_entries(linkcache_t* cache, bucket_t* bucket, UINT32 reserved, UINT32 linked) {
+	UINT32 state, new_state;
+	UINT32 pause = cache->backoff.min_pause;
 
-	if (CAS_PTR((volatile PVOID*)target, (PVOID) oldvalue, (PVOID)mark_ptr_cache((UINT_PTR)value)) != oldvalue) {
-		//abort
+	while (1) {
 		state = bucket->header.local_flags;
-		new_state = state;
-		new_state = mark_free(new_state, i);
+		new_state = (state & ~reserved) | (linked << 1);
+		if (CAS_U32(&bucket->header.local_flags, state, new_state) == state) {
+			break;
+		}
+		backoff(cache, &pause);
+	}
+}
 
-		while (CAS_U16((volatile short*)&bucket->header.local_flags, state, new_state) != state) {
-		    state = bucket->header.local_flags;
-		    new_state = state;
-		    new_state = mark_free(new_state, i);
-			_mm_pause();
+/*
+	group version of cache_try_link_and_add, for updates that need to link several pointers (e.g., a skiplist tower):
+	the entries of all the targets are reserved first, with one CAS per bucket, writing back the full buckets together (one fence);
+	then the targets are linked in order, stopping at the first CAS that fails, and the linked entries are published with one CAS per bucket;
+	the targets that do not fit in the batch (beyond LINK_BATCH_MAX, or more than a bucket holds) are linked one at a time afterwards;
+	returns the number of targets linked (the first ones), less than n only if the CAS of the next one failed
+*/
+int cache_try_link_and_add_n(linkcache_t* cache, int n, UINT64 keys[], volatile void** targets[], volatile void* oldvalues[], volatile void* values[]) {
+	unsigned group_bucket[LINK_BATCH_MAX]; //distinct buckets used by the batch
+	int group_needed[LINK_BATCH_MAX];
+	UINT32 group_reserved[LINK_BATCH_MAX];
+	UINT32 group_linked[LINK_BATCH_MAX];
+	int item_group[LINK_BATCH_MAX];
+	int item_entry[LINK_BATCH_MAX];
+	int full[LINK_BATCH_MAX];
+	int num_groups = 0;
+	int num_full, num_started;
+	wb_batch_t batch;
+	int total = n;
+	int i, g, f;
+
+	if (n > LINK_BATCH_MAX) {
+		n = LINK_BATCH_MAX;
+	}
+
+	//group the targets by bucket; a batch cannot use more entries of a bucket than it has
+	for (i = 0; i < n; i++) {
+		unsigned bucket_num = get_bucket(cache, keys[i]);
+		for (g = 0; g < num_groups; g++) {
+			if (group_bucket[g] == bucket_num) {
+				break;
+			}
 		}
-		return 0;
+		if (g == num_groups) {
+			group_bucket[g] = bucket_num;
+			group_needed[g] = 0;
+			group_reserved[g] = 0;
+			group_linked[g] = 0;
+			num_groups++;
+		}
+		if (group_needed[g] == NUM_ENTRIES_PER_BUCKET) {
+			n = i;
+			break;
+		}
+		group_needed[g]++;
+		item_group[i] = g;
 	}
 
-	state = bucket->header.local_flags;
-	new_state = state;
-	new_state = mark_busy(new_state, i);
+	//Step 1: reserve the entries of every bucket
+	while (1) {
+		num_full = 0;
+		for (g = 0; g < num_groups; g++) {
+			if (group_reserved[g] == 0) {
+				group_reserved[g] = reserve_entries(cache, &cache->buckets[group_bucket[g]], group_needed[g]);
+				if (group_reserved[g] == 0) {
+					full[num_full++] = g;
+				}
+			}
+		}
+		if (num_full == 0) {
+			break;
+		}
 
-	while (CAS_U16((volatile short*)&bucket->header.local_flags, state, new_state) != state) {
-	    state = bucket->header.local_flags;
-	    new_state = state;
-	    new_state = mark_busy(new_state, i);
-		_mm_pause();
+		//write back the full buckets, waiting once for all of them
+		batch.num_buckets = 0;
+			for (f = 0; f < num_full; f++) {
+			bucket_t* bucket = &cache->buckets[group_bucket[full[f]]];
+			if (!no_completed_entries(bucket->header.local_flags)) {
+				bucket_wb_start(cache, group_bucket[full[f]], &batch);
+			}
+		}
+		num_started = batch.num_buckets;
+		for (f = 0; f < num_started; f++) {
+			bucket_wb_start_stash(cache, batch.buckets[f], &batch);
+		}
+		if (batch.num_buckets == 0) {
+			//nothing to write back, or someone else is already doing it: link one target at a time, through the stash if needed
+			for (g = 0; g < num_groups; g++) {
+				if (group_reserved[g] != 0) {
+					release_entries(cache, &cache->buckets[group_bucket[g]], group_reserved[g], 0);
+				}
+			}
+			for (i = 0; i < total; i++) {
+				if (!cache_try_link_and_add(cache, keys[i], targets[i], oldvalues[i], values[i])) {
+					break;
+				}
+			}
+			return i;
+		}
+		wb_batch_complete(cache, &batch);
 	}
 
+	//Step 2: fill in the entries
+	UINT32 unassigned[LINK_BATCH_MAX];
+	for (g = 0; g < num_groups; g++) {
+		unassigned[g] = group_reserved[g];
+	}
+	for (i = 0; i < n; i++) {
+		g = item_group[i];
+		bucket_t* bucket = &cache->buckets[group_bucket[g]];
+		UINT32 entry = unassigned[g] & (~unassigned[g] + 1);
+		unassigned[g] &= unassigned[g] - 1;
+
+		item_entry[i] = entry_index(entry);
+		bucket->addresses[item_entry[i]] = targets[i];
+		bucket->hashes[item_entry[i]] = get_hash(cache, keys[i]);
+	}
 
-	UNUSED PVOID dummy = CAS_PTR((volatile PVOID*)target,(PVOID)mark_ptr_cache((UINT_PTR) value), (PVOID) value);
+	//Step 3: link the targets, in order
+	int linked;
+	for (linked = 0; linked < n; linked++) {
+		if (CAS_PTR((volatile PVOID*)targets[linked], (PVOID)oldvalues[linked], (PVOID)mark_ptr_cache((UINT_PTR)values[linked])) != oldvalues[linked]) {
+			break;
+		}
+		group_linked[item_group[linked]] |= (UINT32)1 << (2 * item_entry[linked]);
+	}
 
-#ifdef DO_PROFILE
-    inserts++;
-#endif
-	return 1;
+	//Step 4: publish the linked entries and free the others, one CAS per bucket
+	for (g = 0; g < num_groups; g++) {
+		release_entries(cache, &cache->buckets[group_bucket[g]], group_reserved[g], group_linked[g]);
+		if (group_linked[g] != 0) {
+			mark_bucket_dirty(cache, group_bucket[g]);
+			record_touched_bucket(cache, group_bucket[g]);
+		}
+	}
+	for (g = 0; g < num_groups; g++) {
+		if (group_linked[g] != 0) {
+			wait_older_write_back(cache, group_bucket[g]);
+		}
+	}
+
+	for (i = 0; i < linked; i++) {
+		UNUSED PVOID dummy = CAS_PTR((volatile PVOID*)targets[i], (PVOID)mark_ptr_cache((UINT_PTR)values[i]), (PVOID)values[i]);
+	}
+
+	nv_stats()->cache_inserts += linked;
+	if (linked < n) {
+		return linked;
+	}
 
+	//the overflow of the batch, one target at a time
+	for (; linked < total; linked++) {
+		if (!cache_try_link_and_add(cache, keys[linked], targets[linked], oldvalues[linked], values[linked])) {
+			break;
+		}
+	}
+	return linked;
 }
 
-int cache_scan(linkcache_t* cache, UINT64 key) {
-	unsigned bucket_num = get_bucket(key);
-	UINT16 hash = get_hash(key);
+/*
+	look for the key in one bucket; returns 1 if a write-back was done or waited for, 0 if there was nothing to flush
+*/
+static int bucket_scan(linkcache_t* cache, unsigned bucket_num, UINT16 hash) {
+	bucket_t* to_search = &cache->buckets[bucket_num];
+	UINT32 seq = to_search->flush_seq;
+	header_t header;
+	header.all = to_search->header.all;
+	UINT32 state = header.local_flags;
+	UINT32 matches = all_free(state) ? 0 : match_hashes(to_search, hash);
+	if (busy_entries(state) & matches) {
+		if (!bucket_wb(cache, bucket_num)) {
+			bucket_wb_after(cache, bucket_num, seq);
+		}
+		return 1;
+	}
+	if (header.write_back_lock) {
+		//the entry of the key may have been freed by this write-back, whose lines may only be written back when it completes
+		bucket_wb_wait(cache, bucket_num, seq);
+		return 1;
+	}
+	//if an entry for the key is there, it is pending, and the pointer has been marked (meaning the link happened), then I shpuld flush the pointer before I return
+	UINT32 pending;
+	for (pending = pending_entries(state) & matches; pending != 0; pending &= pending - 1) {
+		int i = entry_index(pending);
+		void* val = *(void**)(to_search->addresses[i]);
+		if (is_marked_ptr_cache((UINT_PTR)val)) {
+			write_data_wait_at((void*)to_search->addresses[i], sizeof(void*), NV_SITE_LINK_CACHE);
+			return 1;
+		}
+	}
+	return 0;
+}
 
-	bucket_t* to_search = cache->buckets[bucket_num];
-	if (all_free(to_search->header.local_flags)) {
+/*
+	whether the bucket may hold the link of slot in a busy entry, or in an entry freed by a write-back which has not completed yet
+*/
+static int bucket_holds_link(linkcache_t* cache, unsigned bucket_num, UINT16 hash, volatile void** slot) {
+	//targets are only unmarked once no write-back can clear the bit of their bucket before persisting them
+	if (!is_bucket_dirty(cache, bucket_num)) {
 		return 0;
 	}
-	int i;
-	for (i = 0; i < NUM_ENTRIES_PER_BUCKET; i++) {
-		if ((to_search->hashes[i] == hash)) {
-			if (is_busy(to_search->header.local_flags, i)) {
-				return bucket_wb(cache, bucket_num);
-			}
-			//if an entry for the key is there, it is pending, and the pointer has been marked (meaning the link happened), then I shpuld flush the pointer before I return
-			else if ((is_pending(to_search->header.local_flags, i)) && (is_marked_ptr_cache((UINT_PTR)*(void**)(to_search->addresses[i])))){
-				void* val = *(void**)(to_search->addresses[i]);
-				write_data_wait((void*)unmark_ptr_cache((UINT_PTR)val), 1);
-                return 1;
-			}
+	bucket_t* bucket = &cache->buckets[bucket_num];
+	UINT32 seq = bucket->flush_seq;
+	header_t header;
+	header.all = bucket->header.all;
+	if (header.write_back_lock) {
+		return 1;
+	}
+	UINT32 busy;
+	for (busy = busy_entries(header.local_flags) & match_hashes(bucket, hash); busy != 0; busy &= busy - 1) {
+		if (bucket->addresses[entry_index(busy)] == slot) {
+			return 1;
 		}
 	}
-	return 0;
+	//the entries read above could have been freed and reused by a write-back in the meantime
+	return (bucket->header.write_back_lock != 0) || (bucket->flush_seq != seq);
+}
+
+void* cache_read_persisted(linkcache_t* cache, UINT64 key, volatile void** slot) {
+	UINT_PTR val = (UINT_PTR)*slot;
+
+	//a marked link is not persistent yet; once the mark is cleared, the link is persistent unless its entry is still in the cache
+	if (!is_marked_ptr_cache(val)) {
+		unsigned bucket_num = get_bucket(cache, key);
+		if (!bucket_holds_link(cache, bucket_num, get_hash(cache, key), slot) &&
+				!bucket_holds_link(cache, get_stash_bucket(cache, bucket_num), get_stash_hash(key), slot)) {
+			return (void*)val;
+		}
+	}
+
+	//persist the slot here rather than waiting for the bucket to be written back
+	write_data_wait_at((void*)slot, sizeof(void*), NV_SITE_LINK_CACHE);
+	return (void*)unmark_ptr_cache(val);
+}
+
+int cache_scan(linkcache_t* cache, UINT64 key) {
+	unsigned bucket_num = get_bucket(cache, key);
+
+	if (bucket_scan(cache, bucket_num, get_hash(cache, key))) {
+		return 1;
+	}
+	//links which did not fit in their bucket are in the stash
+	return bucket_scan(cache, get_stash_bucket(cache, bucket_num), get_stash_hash(key));
 }
 
 int cache_size(linkcache_t* cache) {
     int size = 0;
-    int i;
-    int j;
-    UINT16 state;
+    UINT32 shard;
+    UINT64 dirty;
 
     //count the number of entries with state busy
-    for (i = 0; i < NUM_BUCKETS; i++) {
-        state = cache->buckets[i]->header.local_flags;
-        for (j = 0; j < NUM_ENTRIES_PER_BUCKET; j++) {
-            if (is_busy(state, j)) {
-                size++;
-            }
-        } 
+    for (shard = 0; shard < cache->num_dirty_shards; shard++) {
+        for (dirty = cache->dirty[shard].buckets; dirty != 0; dirty &= dirty - 1) {
+            UINT32 i = shard * BUCKETS_PER_DIRTY_SHARD + __builtin_ctzll(dirty);
+            size += __builtin_popcount(busy_entries(cache->buckets[i].header.local_flags));
+        }
     }
 
     return size;
 }
+
+/*
+	background flusher
+*/
+
+void cache_flusher_default_config(flusher_config_t* config) {
+	config->high_watermark = DEFAULT_FLUSHER_HIGH_WATERMARK;
+	config->cpu = -1;
+	config->period_us = DEFAULT_FLUSHER_PERIOD_US;
+	config->duty_cycle = DEFAULT_FLUSHER_DUTY_CYCLE;
+}
+
+static UINT64 flusher_now_ns() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (UINT64)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void* cache_flusher(void* arg) {
+	linkcache_t* cache = (linkcache_t*)arg;
+	flusher_config_t* config = &cache->flusher_config;
+	UINT32 i, shard;
+	UINT64 dirty;
+
+	if (config->cpu >= 0) {
+		cpu_set_t cpus;
+		CPU_ZERO(&cpus);
+		CPU_SET(config->cpu, &cpus);
+		if (pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &cpus) != 0) {
+			fprintf(stderr, "could not pin the link cache flusher to core %d\n", config->cpu);
+		}
+	}
+
+	while (cache->flusher_running) {
+		UINT64 start = flusher_now_ns();
+
+		//a bucket which is not dirty has nothing to write back yet
+		for (shard = 0; shard < cache->num_dirty_shards; shard++) {
+			for (dirty = cache->dirty[shard].buckets; dirty != 0; dirty &= dirty - 1) {
+				i = shard * BUCKETS_PER_DIRTY_SHARD + __builtin_ctzll(dirty);
+				UINT32 state = cache->buckets[i].header.local_flags;
+				UINT32 in_use = NUM_ENTRIES_PER_BUCKET - __builtin_popcount(free_entries(state));
+				if ((in_use >= config->high_watermark) && !no_completed_entries(state)) {
+					bucket_wb(cache, i);
+				}
+			}
+		}
+
+		//sleep at least one period, and long enough to stay within the duty cycle
+		UINT64 worked = flusher_now_ns() - start;
+		UINT64 pause = (UINT64)config->period_us * 1000;
+		if ((config->duty_cycle > 0) && (config->duty_cycle < 100)) {
+			UINT64 idle = worked * (100 - config->duty_cycle) / config->duty_cycle;
+			if (idle > pause) {
+				pause = idle;
+			}
+		}
+		struct timespec timeout;
+		timeout.tv_sec = pause / 1000000000ULL;
+		timeout.tv_nsec = pause % 1000000000ULL;
+		nanosleep(&timeout, NULL);
+	}
+
+	return NULL;
+}
+
+int cache_start_flusher(linkcache_t* cache, const flusher_config_t* config) {
+	if (cache->flusher_running) {
+		return 0;
+	}
+
+	if (config != NULL) {
+		cache->flusher_config = *config;
+	}
+	else {
+		cache_flusher_default_config(&cache->flusher_config);
+	}
+	if (cache->flusher_config.high_watermark == 0) {
+		cache->flusher_config.high_watermark = 1;
+	}
+
+	cache->flusher_running = 1;
+	_mm_sfence();
+	if (pthread_create(&cache->flusher, NULL, cache_flusher, cache) != 0) {
+		cache->flusher_running = 0;
+		return -1;
+	}
+	return 0;
+}
+
+void cache_stop_flusher(linkcache_t* cache) {
+	if (!cache->flusher_running) {
+		return;
+	}
+	cache->flusher_running = 0;
+	_mm_sfence();
+	pthread_join(cache->flusher, NULL);
+}
@@ -29,6 +29,10 @@
 int num_threads = 1;
 int duration = 1000;
 int seed = 0;
+int wb_all_period = 0;
+int wb_touched_period = 0;
+int read_persisted = 0;
+int batch_size = 1;
 __thread unsigned long * seeds;
 uint32_t rand_max;
 void** data;
@@ -38,15 +42,6 @@ void** data;
 static volatile int stop;
 
 
-#ifdef DO_PROFILE
-__thread uint64_t inserts;
-__thread uint64_t removes;
-#ifdef TSX_ENABLED
-__thread uint64_t inserts_tsx;
-#endif
-#endif
-
-
 /*
  *  Barrier
  */
@@ -97,37 +92,165 @@ void* test(void* thread) {
   thread_data_t* td = (thread_data_t*) thread;
   uint8_t ID = td->id;
   linkcache_t* lc = td->lc;
-#ifdef DO_PROFILE
-  inserts = 0;
-  removes = 0;
-#endif
 
   seeds = seed_rand();
 
+  touched_buckets_t touched;
+  if (wb_touched_period > 0) {
+    cache_track_touched_buckets(&touched);
+  }
+
   barrier_cross(&barrier_global);
 
+  uint64_t ops = 0;
+  UINT64 keys[LINK_BATCH_MAX];
+  volatile void** targets[LINK_BATCH_MAX];
+  volatile void* olds[LINK_BATCH_MAX];
+  volatile void* news[LINK_BATCH_MAX];
+  int j;
   while (stop == 0) {
+    if (batch_size > 1) {
+      for (j = 0; j < batch_size; j++) {
+        keys[j] = (my_random(&(seeds[0]), &(seeds[1]), &(seeds[2])) % rand_max);
+        targets[j] = (volatile void**) &(data[keys[j]]);
+        olds[j] = data[keys[j]];
+        news[j] = (void*)((uintptr_t) (ID+1));
+      }
+      cache_try_link_and_add_n(lc, batch_size, keys, targets, olds, news);
+    } else {
 	  uint64_t next = (my_random(&(seeds[0]), &(seeds[1]), &(seeds[2])) % rand_max);
       void* old = data[next];
       void* new_1 = (void*)((uintptr_t) (ID+1));
       cache_try_link_and_add(lc, next, (volatile void**) &(data[next]), old, new_1);
+    }
+    if (read_persisted) {
+      uint64_t key = (my_random(&(seeds[0]), &(seeds[1]), &(seeds[2])) % rand_max);
+      void* val = cache_read_persisted(lc, key, (volatile void**) &(data[key]));
+      if (is_marked_ptr_cache((UINT_PTR) val)) {
+        printf("Marked value read from slot %lu\n", key);
+      }
+    }
+      ops++;
+      if ((wb_all_period > 0) && ((ops % wb_all_period) == 0)) {
+        cache_wb_all_buckets(lc);
+      }
+      if ((wb_touched_period > 0) && ((ops % wb_touched_period) == 0)) {
+        cache_wb_touched_buckets(lc, &touched);
+      }
   }
+  cache_track_touched_buckets(NULL);
 
   barrier_cross(&barrier);
 
-#ifdef DO_PROFILE
-  td->removed = removes;
-  td->inserted = inserts;
-#ifdef TSX_ENABLED
-  fprintf(stderr, "Thread %d: %lu inserts, out of which %lu through HTM, %lu removes\n", ID, inserts, inserts_tsx, removes);
-#else
-  fprintf(stderr, "Thread %d: %lu inserts, %lu removes\n", ID, inserts, removes);
-#endif
-#endif
+  nv_thread_stats_t* stats = nv_stats();
+  td->removed = stats->cache_removes;
+  td->inserted = stats->cache_inserts;
   barrier_cross(&barrier_global);
   pthread_exit(NULL);
 }
 
+/*
+ *  nv_memcpy_persist and nv_memset_persist against memcpy and memset, at
+ *  every offset within a line and every length up to a few lines, in each
+ *  flush mode the CPU supports
+ */
+
+#define PERSIST_CHECK_LINES 8
+
+static void check_persist_copies() {
+  size_t size = (PERSIST_CHECK_LINES + 2) * CACHE_LINE_SIZE;
+  char* src = (char*) memalign(CACHE_LINE_SIZE, size);
+  char* dest = (char*) memalign(CACHE_LINE_SIZE, size);
+  char* expected = (char*) malloc(size);
+  nv_flush_mode_t old_mode = nv_flush_mode;
+  size_t i, off, len;
+  int mode;
+
+  for (i = 0; i < size; i++) {
+    src[i] = (char) (i * 7 + 1);
+  }
+
+  for (mode = NV_FLUSH_CLFLUSH; mode <= NV_FLUSH_SIMULATED; mode++) {
+    if (nv_set_flush_mode((nv_flush_mode_t) mode) != mode) {
+      continue;
+    }
+    for (off = 0; off < CACHE_LINE_SIZE; off++) {
+      for (len = 0; len <= PERSIST_CHECK_LINES * CACHE_LINE_SIZE; len++) {
+	//the source is misaligned differently from the destination
+	const char* from = src + (off + 13) % CACHE_LINE_SIZE;
+
+	memset(dest, 0x5a, size);
+	memset(expected, 0x5a, size);
+	memcpy(expected + off, from, len);
+	nv_memcpy_persist(dest + off, from, len);
+	if (memcmp(dest, expected, size) != 0) {
+	  printf("Incorrect nv_memcpy_persist in %s mode: offset %lu, length %lu.\n", nv_flush_mode_name((nv_flush_mode_t) mode), off, len);
+	  exit(1);
+	}
+
+	memset(expected + off, (int) len, len);
+	nv_memset_persist(dest + off, (int) len, len);
+	if (memcmp(dest, expected, size) != 0) {
+	  printf("Incorrect nv_memset_persist in %s mode: offset %lu, length %lu.\n", nv_flush_mode_name((nv_flush_mode_t) mode), off, len);
+	  exit(1);
+	}
+      }
+    }
+  }
+
+  nv_set_flush_mode(old_mode);
+  free(src);
+  free(dest);
+  free(expected);
+  printf("Correct persistent copies.\n");
+}
+
+/*
+ *  Deferred write-backs: each distinct line is written back once, by the
+ *  next wait_writes at the latest, or as soon as the set of lines is full
+ */
+
+static void check_deferred_writes() {
+  char* buf = (char*) memalign(CACHE_LINE_SIZE, (NV_FLUSH_BUFFER_SIZE + 1) * CACHE_LINE_SIZE);
+  size_t old_batch = nv_flush_batch;
+  nv_site_stats_t* site = &nv_stats()->sites[NV_SITE_USER];
+  uint64_t before;
+  int i;
+
+  nv_set_flush_batch(NV_FLUSH_BUFFER_SIZE);
+  wait_writes();
+
+  //overlapping ranges over three lines
+  before = site->lines_flushed;
+  write_data_deferred(buf + 8, 16);
+  write_data_deferred(buf + CACHE_LINE_SIZE - 4, 10);
+  write_data_deferred(buf + 2 * CACHE_LINE_SIZE, CACHE_LINE_SIZE);
+  write_data_deferred(buf + CACHE_LINE_SIZE + 4, 4);
+  if (nv_flush_buffer.num_lines != 3 || site->lines_flushed - before != 3) {
+    printf("Incorrect deferred writes: %lu lines pending, %lu counted (expected 3).\n", nv_flush_buffer.num_lines, site->lines_flushed - before);
+    exit(1);
+  }
+  wait_writes();
+  if (nv_flush_buffer.num_lines != 0) {
+    printf("Incorrect deferred writes: %lu lines left after wait_writes.\n", nv_flush_buffer.num_lines);
+    exit(1);
+  }
+
+  //one line more than the set holds
+  for (i = 0; i <= NV_FLUSH_BUFFER_SIZE; i++) {
+    write_data_deferred(buf + i * CACHE_LINE_SIZE, 1);
+  }
+  if (nv_flush_buffer.num_lines != 1) {
+    printf("Incorrect deferred writes: %lu lines pending after the set filled up (expected 1).\n", nv_flush_buffer.num_lines);
+    exit(1);
+  }
+  wait_writes();
+
+  nv_set_flush_batch(old_batch);
+  free(buf);
+  printf("Correct deferred writes.\n");
+}
+
 /*
  * 
  * Link cahe interface:
@@ -147,16 +270,26 @@ int main(int argc, char **argv) {
     {"duration",                  required_argument, NULL, 'd'},
     {"num-threads",               required_argument, NULL, 'n'},
     {"range",                     required_argument, NULL, 'r'},
+    {"buckets",                   required_argument, NULL, 'b'},
+    {"flusher",                   required_argument, NULL, 'f'},
+    {"wb-all",                    required_argument, NULL, 'w'},
+    {"wb-touched",                required_argument, NULL, 't'},
+    {"read-persisted",            no_argument,       NULL, 'p'},
+    {"max-pause",                 required_argument, NULL, 'm'},
+    {"batch",                     required_argument, NULL, 'g'},
     {NULL, 0, NULL, 0}
   };
 
   size_t range = 2048;
+  unsigned num_buckets = DEFAULT_NUM_BUCKETS;
+  int flusher_watermark = 0;
+  int max_pause = 0;
 
   int i, c;
   while(1) 
     {
       i = 0;
-      c = getopt_long(argc, argv, "hd:n:r:", long_options, &i);
+      c = getopt_long(argc, argv, "hd:n:r:b:f:w:t:pm:g:", long_options, &i);
 		
       if(c == -1)
 	break;
@@ -183,6 +316,20 @@ int main(int argc, char **argv) {
 		 "        Number of threads\n"
 		 "  -r, --range <int>\n"
 		 "        Range of integer values inserted in set for testing\n"
+		 "  -b, --buckets <int>\n"
+		 "        Number of link cache buckets (rounded up to a power of two)\n"
+		 "  -f, --flusher <int>\n"
+		 "        Run the background flusher, writing back buckets with at least this many entries in use\n"
+		 "  -w, --wb-all <int>\n"
+		 "        Each thread writes back the whole cache every this many operations\n"
+		 "  -t, --wb-touched <int>\n"
+		 "        Each thread writes back the buckets it linked into every this many operations\n"
+		 "  -p, --read-persisted\n"
+		 "        Also read one random target per operation with cache_read_persisted\n"
+		 "  -m, --max-pause <int>\n"
+		 "        Maximum backoff after a failed CAS on a bucket header, in pause instructions (1 disables the backoff)\n"
+		 "  -g, --batch <int>\n"
+		 "        Link this many random targets per operation with cache_try_link_and_add_n\n"
 		 );
 	  exit(0);
 	case 'd':
@@ -194,6 +341,30 @@ int main(int argc, char **argv) {
 	case 'r':
 	  range = atol(optarg);
 	  break;
+	case 'b':
+	  num_buckets = atoi(optarg);
+	  break;
+	case 'f':
+	  flusher_watermark = atoi(optarg);
+	  break;
+	case 'w':
+	  wb_all_period = atoi(optarg);
+	  break;
+	case 't':
+	  wb_touched_period = atoi(optarg);
+	  break;
+	case 'p':
+	  read_persisted = 1;
+	  break;
+	case 'm':
+	  max_pause = atoi(optarg);
+	  break;
+	case 'g':
+	  batch_size = atoi(optarg);
+	  if (batch_size > LINK_BATCH_MAX) {
+	    batch_size = LINK_BATCH_MAX;
+	  }
+	  break;
 	case '?':
 	default:
 	  printf("Use -h or --help for help\n");
@@ -201,10 +372,23 @@ int main(int argc, char **argv) {
 	}
     }
 
-  linkcache_t* lc = cache_create();
+  backoff_config_t backoff;
+  cache_backoff_default_config(&backoff);
+  if (max_pause > 0) {
+    backoff.max_pause = max_pause;
+  }
+  linkcache_t* lc = cache_create_with_backoff(num_buckets, &backoff);
+  check_persist_copies();
+  check_deferred_writes();
+  if (flusher_watermark > 0) {
+    flusher_config_t config;
+    cache_flusher_default_config(&config);
+    config.high_watermark = flusher_watermark;
+    cache_start_flusher(lc, &config);
+  }
 
 
-  printf("# threads: %d / range: %zu\n", num_threads, range);
+  printf("# threads: %d / range: %zu / buckets: %u\n", num_threads, range, lc->num_buckets);
 
   struct timeval start, end;
   struct timespec timeout;
@@ -280,16 +464,19 @@ int main(int argc, char **argv) {
   uint64_t sum_removed = 0;
   uint64_t current_size;
 
-  current_size = 0;
-#ifdef DO_PROFILE
+  //the flusher removes entries too, so stop it before counting
+  cache_stop_flusher(lc);
   current_size = cache_size(lc);
-#endif
 
  for (t=0; t< num_threads; t++) {
     sum_inserted+=tds[t].inserted;
-    sum_removed+=tds[t].removed;
  }
 
+  //all the threads' removes, including the ones of the flusher
+  nv_thread_stats_t total;
+  nv_stats_snapshot(&total);
+  sum_removed = total.cache_removes;
+
  if ((sum_removed + current_size) != sum_inserted) {
     printf("Incorrect element count.\n");
     printf("Inserted: %lu\n", sum_inserted);
@@ -302,6 +489,13 @@ int main(int argc, char **argv) {
     printf("Elements currently in the cache: %lu\n", current_size);
  }
 
+  cache_wb_all_buckets(lc);
+  if (cache_size(lc) != 0) {
+    printf("Entries left in the cache after writing back all buckets: %d\n", cache_size(lc));
+  }
+
+  nv_stats_print(stdout, &total);
+
   free(tds);
   cache_destroy(lc);
 
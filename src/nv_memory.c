@@ -0,0 +1,468 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <malloc.h>
+#include <cpuid.h>
+#include <time.h>
+
+#include "nv_memory.h"
+
+//clflush is available on every x86-64 CPU, so it is a safe choice until nv_memory_init is called
+nv_flush_mode_t nv_flush_mode = NV_FLUSH_CLFLUSH;
+
+static volatile int nv_memory_initialized = 0;
+
+nv_emulation_t nv_emulation;
+
+volatile ULONG64 nv_device_busy_until CACHE_ALIGNED = 0;
+
+__thread ULONG64 nv_thread_busy_until = 0;
+
+__thread ULONG64 nv_pending_until = 0;
+__thread ULONG64 nv_pending_lines = 0;
+
+__thread nv_flush_buffer_t nv_flush_buffer;
+
+size_t nv_flush_batch = NV_FLUSH_BUFFER_SIZE;
+
+__thread nv_thread_stats_t* nv_thread_stats = NULL;
+
+static nv_thread_stats_t* volatile nv_all_thread_stats = NULL;
+
+static nv_emulation_config_t nv_emulation_config;
+static int nv_emulation_configured = 0;
+
+typedef void (*movnt_copy_fn)(char* dest, const char* src, size_t lines);
+typedef void (*movnt_set_fn)(char* dest, int c, size_t lines);
+
+static void movnt_copy_sse2(char* dest, const char* src, size_t lines);
+static void movnt_set_sse2(char* dest, int c, size_t lines);
+
+//SSE2 is available on every x86-64 CPU; the wider kernels are selected by nv_set_flush_mode
+static movnt_copy_fn movnt_copy = movnt_copy_sse2;
+static movnt_set_fn movnt_set = movnt_set_sse2;
+
+static void select_movnt_kernels();
+
+#define CPUID_EDX_CLFLUSH (1 << 19)
+#define CPUID_EBX_CLFLUSHOPT (1 << 23)
+#define CPUID_EBX_CLWB (1 << 24)
+
+//each instruction has its own CPUID bit, none of them implies another
+static int nv_flush_mode_supported(nv_flush_mode_t mode) {
+	unsigned eax, ebx, ecx, edx;
+
+	switch (mode) {
+	case NV_FLUSH_SIMULATED:
+		return 1;
+	case NV_FLUSH_CLFLUSH:
+		return __get_cpuid(1, &eax, &ebx, &ecx, &edx) && (edx & CPUID_EDX_CLFLUSH);
+	case NV_FLUSH_CLFLUSHOPT:
+		return __get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx) && (ebx & CPUID_EBX_CLFLUSHOPT);
+	case NV_FLUSH_CLWB:
+		return __get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx) && (ebx & CPUID_EBX_CLWB);
+	}
+	return 0;
+}
+
+nv_flush_mode_t nv_detect_flush_mode() {
+	if (nv_flush_mode_supported(NV_FLUSH_CLWB)) {
+		return NV_FLUSH_CLWB;
+	}
+	if (nv_flush_mode_supported(NV_FLUSH_CLFLUSHOPT)) {
+		return NV_FLUSH_CLFLUSHOPT;
+	}
+	if (nv_flush_mode_supported(NV_FLUSH_CLFLUSH)) {
+		return NV_FLUSH_CLFLUSH;
+	}
+	//no flush instruction at all: only the simulator is left
+	return NV_FLUSH_SIMULATED;
+}
+
+const char* nv_flush_mode_name(nv_flush_mode_t mode) {
+	switch (mode) {
+	case NV_FLUSH_CLFLUSH:
+		return "clflush";
+	case NV_FLUSH_CLFLUSHOPT:
+		return "clflushopt";
+	case NV_FLUSH_CLWB:
+		return "clwb";
+	case NV_FLUSH_SIMULATED:
+		return "simulate";
+	}
+	return "unknown";
+}
+
+nv_flush_mode_t nv_set_flush_mode(nv_flush_mode_t mode) {
+	if (!nv_flush_mode_supported(mode)) {
+		nv_flush_mode_t best = nv_detect_flush_mode();
+		fprintf(stderr, "%s not supported by this CPU, using %s\n", nv_flush_mode_name(mode), nv_flush_mode_name(best));
+		mode = best;
+	}
+
+	select_movnt_kernels();
+
+	if ((mode == NV_FLUSH_SIMULATED) && (!nv_emulation_configured)) {
+		nv_emulation_configure(NULL);
+	}
+
+	nv_memory_initialized = 1;
+	nv_flush_mode = mode;
+	_mm_sfence();
+	return mode;
+}
+
+size_t nv_set_flush_batch(size_t lines) {
+	if (lines > NV_FLUSH_BUFFER_SIZE) {
+		lines = NV_FLUSH_BUFFER_SIZE;
+	}
+	nv_flush_batch = lines;
+	_mm_sfence();
+	return lines;
+}
+
+void nv_memory_init() {
+	if (nv_memory_initialized) {
+		return;
+	}
+
+	nv_flush_mode_t mode = nv_detect_flush_mode();
+
+	const char* env = getenv("NV_FLUSH_MODE");
+	if ((env != NULL) && (strcmp(env, "auto") != 0)) {
+		int m;
+		for (m = NV_FLUSH_CLFLUSH; m <= NV_FLUSH_SIMULATED; m++) {
+			if (strcmp(env, nv_flush_mode_name((nv_flush_mode_t)m)) == 0) {
+				break;
+			}
+		}
+		if (m > NV_FLUSH_SIMULATED) {
+			fprintf(stderr, "unknown NV_FLUSH_MODE %s, using %s\n", env, nv_flush_mode_name(mode));
+		}
+		else {
+			mode = (nv_flush_mode_t)m;
+		}
+	}
+
+	nv_set_flush_mode(mode);
+}
+
+/*
+	instrumentation
+*/
+
+nv_thread_stats_t* nv_stats_register_thread() {
+	nv_thread_stats_t* stats = (nv_thread_stats_t*)memalign(CACHE_LINE_SIZE, sizeof(nv_thread_stats_t));
+	memset(stats, 0, sizeof(nv_thread_stats_t));
+
+	nv_thread_stats_t* head;
+	do {
+		head = nv_all_thread_stats;
+		stats->next = head;
+	} while (CAS_PTR(&nv_all_thread_stats, head, stats) != head);
+
+	nv_thread_stats = stats;
+	return stats;
+}
+
+void nv_stats_snapshot(nv_thread_stats_t* total) {
+	int i;
+
+	memset(total, 0, sizeof(nv_thread_stats_t));
+
+	nv_thread_stats_t* curr = nv_all_thread_stats;
+	while (curr != NULL) {
+		for (i = 0; i < NV_NUM_SITES; i++) {
+			total->sites[i].lines_flushed += curr->sites[i].lines_flushed;
+			total->sites[i].fences += curr->sites[i].fences;
+			total->sites[i].stall_cycles += curr->sites[i].stall_cycles;
+		}
+		total->cache_inserts += curr->cache_inserts;
+		total->cache_inserts_tsx += curr->cache_inserts_tsx;
+		total->cache_removes += curr->cache_removes;
+		total->cache_direct_links += curr->cache_direct_links;
+		total->cache_cas_failures += curr->cache_cas_failures;
+		total->page_marks += curr->page_marks;
+		total->page_hits += curr->page_hits;
+		total->page_mru_hits += curr->page_mru_hits;
+		curr = curr->next;
+	}
+}
+
+const char* nv_site_name(nv_site_t site) {
+	switch (site) {
+	case NV_SITE_USER:
+		return "user";
+	case NV_SITE_LINK_CACHE:
+		return "link-cache";
+	case NV_SITE_PAGE_TABLE:
+		return "active-page-table";
+	case NV_SITE_EPOCH:
+		return "epoch";
+	default:
+		return "unknown";
+	}
+}
+
+void nv_stats_print(FILE* out, nv_thread_stats_t* stats) {
+	int i;
+
+	for (i = 0; i < NV_NUM_SITES; i++) {
+		nv_site_stats_t* site = &stats->sites[i];
+		if ((site->lines_flushed == 0) && (site->fences == 0)) {
+			continue;
+		}
+		fprintf(out, "%s: %lu lines flushed, %lu fences, %lu cycles stalled\n", nv_site_name((nv_site_t)i),
+				site->lines_flushed, site->fences, site->stall_cycles);
+	}
+	fprintf(out, "link cache: %lu inserts (%lu through HTM), %lu removes, %lu links persisted directly, %lu failed bucket header CASes\n",
+			stats->cache_inserts, stats->cache_inserts_tsx, stats->cache_removes, stats->cache_direct_links, stats->cache_cas_failures);
+	fprintf(out, "active page table: %lu marks, %lu hits (%lu on recently marked pages)\n", stats->page_marks, stats->page_hits, stats->page_mru_hits);
+}
+
+/*
+	latency emulation
+*/
+
+static UINT64 env_or_default(const char* name, UINT64 def) {
+	const char* env = getenv(name);
+	if (env == NULL) {
+		return def;
+	}
+	return strtoull(env, NULL, 10);
+}
+
+static UINT64 monotonic_ns() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (UINT64)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+double nv_calibrate_tsc() {
+	//10ms is enough to get the frequency within a fraction of a percent
+	UINT64 startNs = monotonic_ns();
+	ULONG64 startCycles = nv_getticks();
+	UINT64 ns;
+	do {
+		ns = monotonic_ns();
+	} while (ns - startNs < 10000000ULL);
+	ULONG64 cycles = nv_getticks();
+
+	return (double)(cycles - startCycles) / (double)(ns - startNs);
+}
+
+void nv_emulation_configure(const nv_emulation_config_t* config) {
+	if (nv_emulation.tsc_per_ns == 0) {
+		nv_emulation.tsc_per_ns = nv_calibrate_tsc();
+	}
+
+	if (config != NULL) {
+		nv_emulation_config = *config;
+	}
+	else {
+		nv_emulation_config.write_latency_ns = env_or_default("NV_EMUL_WRITE_LATENCY_NS", NV_EMUL_DEFAULT_WRITE_LATENCY_NS);
+		nv_emulation_config.fence_latency_ns = env_or_default("NV_EMUL_FENCE_LATENCY_NS", NV_EMUL_DEFAULT_FENCE_LATENCY_NS);
+		nv_emulation_config.bandwidth_mbps = env_or_default("NV_EMUL_BANDWIDTH_MBPS", NV_EMUL_DEFAULT_BANDWIDTH_MBPS);
+		nv_emulation_config.shared_bandwidth = env_or_default("NV_EMUL_SHARED_BANDWIDTH", 0);
+	}
+
+	double tsc_per_ns = nv_emulation.tsc_per_ns;
+	nv_emulation.write_latency_cycles = (ULONG64)(nv_emulation_config.write_latency_ns * tsc_per_ns);
+	nv_emulation.fence_latency_cycles = (ULONG64)(nv_emulation_config.fence_latency_ns * tsc_per_ns);
+	nv_emulation.shared_bandwidth = (nv_emulation_config.shared_bandwidth != 0);
+	if (nv_emulation_config.bandwidth_mbps == 0) {
+		nv_emulation.line_cycles = 0;
+	}
+	else {
+		//1 MB/s is 1 byte per us
+		nv_emulation.line_cycles = (ULONG64)((CACHE_LINE_SIZE * 1000.0 / nv_emulation_config.bandwidth_mbps) * tsc_per_ns);
+	}
+
+	nv_emulation_configured = 1;
+	_mm_sfence();
+}
+
+void nv_emulation_get_config(nv_emulation_config_t* config) {
+	*config = nv_emulation_config;
+}
+
+/*
+	non-temporal kernels: dest is cache line aligned, and whole cache lines are written
+*/
+
+static void movnt_copy_sse2(char* dest, const char* src, size_t lines) {
+	size_t i;
+
+	for (i = 0; i < lines; i++) {
+		__m128i x0 = _mm_loadu_si128((const __m128i*)src);
+		__m128i x1 = _mm_loadu_si128((const __m128i*)(src + 16));
+		__m128i x2 = _mm_loadu_si128((const __m128i*)(src + 32));
+		__m128i x3 = _mm_loadu_si128((const __m128i*)(src + 48));
+		_mm_stream_si128((__m128i*)dest, x0);
+		_mm_stream_si128((__m128i*)(dest + 16), x1);
+		_mm_stream_si128((__m128i*)(dest + 32), x2);
+		_mm_stream_si128((__m128i*)(dest + 48), x3);
+		src += CACHE_LINE_SIZE;
+		dest += CACHE_LINE_SIZE;
+	}
+}
+
+static void movnt_set_sse2(char* dest, int c, size_t lines) {
+	size_t i;
+	__m128i x = _mm_set1_epi8((char)c);
+
+	for (i = 0; i < lines; i++) {
+		_mm_stream_si128((__m128i*)dest, x);
+		_mm_stream_si128((__m128i*)(dest + 16), x);
+		_mm_stream_si128((__m128i*)(dest + 32), x);
+		_mm_stream_si128((__m128i*)(dest + 48), x);
+		dest += CACHE_LINE_SIZE;
+	}
+}
+
+__attribute__((target("avx2")))
+static void movnt_copy_avx2(char* dest, const char* src, size_t lines) {
+	size_t i;
+
+	for (i = 0; i < lines; i++) {
+		__m256i y0 = _mm256_loadu_si256((const __m256i*)src);
+		__m256i y1 = _mm256_loadu_si256((const __m256i*)(src + 32));
+		_mm256_stream_si256((__m256i*)dest, y0);
+		_mm256_stream_si256((__m256i*)(dest + 32), y1);
+		src += CACHE_LINE_SIZE;
+		dest += CACHE_LINE_SIZE;
+	}
+}
+
+__attribute__((target("avx2")))
+static void movnt_set_avx2(char* dest, int c, size_t lines) {
+	size_t i;
+	__m256i y = _mm256_set1_epi8((char)c);
+
+	for (i = 0; i < lines; i++) {
+		_mm256_stream_si256((__m256i*)dest, y);
+		_mm256_stream_si256((__m256i*)(dest + 32), y);
+		dest += CACHE_LINE_SIZE;
+	}
+}
+
+__attribute__((target("avx512f")))
+static void movnt_copy_avx512f(char* dest, const char* src, size_t lines) {
+	size_t i;
+
+	for (i = 0; i < lines; i++) {
+		__m512i z = _mm512_loadu_si512((const void*)src);
+		_mm512_stream_si512((__m512i*)dest, z);
+		src += CACHE_LINE_SIZE;
+		dest += CACHE_LINE_SIZE;
+	}
+}
+
+__attribute__((target("avx512f")))
+static void movnt_set_avx512f(char* dest, int c, size_t lines) {
+	size_t i;
+	__m512i z = _mm512_set1_epi32(0x01010101 * (unsigned char)c);
+
+	for (i = 0; i < lines; i++) {
+		_mm512_stream_si512((__m512i*)dest, z);
+		dest += CACHE_LINE_SIZE;
+	}
+}
+
+static void select_movnt_kernels() {
+	__builtin_cpu_init();
+
+	if (__builtin_cpu_supports("avx512f")) {
+		movnt_copy = movnt_copy_avx512f;
+		movnt_set = movnt_set_avx512f;
+	}
+	else if (__builtin_cpu_supports("avx2")) {
+		movnt_copy = movnt_copy_avx2;
+		movnt_set = movnt_set_avx2;
+	}
+	else {
+		movnt_copy = movnt_copy_sse2;
+		movnt_set = movnt_set_sse2;
+	}
+}
+
+void* nv_memcpy_persist(void* dest, const void* src, size_t len) {
+	if ((len < NV_MOVNT_THRESHOLD) || (nv_flush_mode == NV_FLUSH_SIMULATED)) {
+		memcpy(dest, src, len);
+		write_data_wait(dest, len);
+		return dest;
+	}
+
+	ULONG64 start = nv_getticks();
+	nv_site_stats_t* stats = &nv_stats()->sites[NV_SITE_USER];
+	stats->lines_flushed += lines_spanned(dest, len);
+
+	char* d = (char*)dest;
+	const char* s = (const char*)src;
+
+	//copy the unaligned head through the cache, so that the streaming stores cover whole lines
+	size_t head = (CACHE_LINE_SIZE - ((UINT_PTR)d & (CACHE_LINE_SIZE - 1))) & (CACHE_LINE_SIZE - 1);
+	if (head != 0) {
+		memcpy(d, s, head);
+		flush_lines(d, head);
+		d += head;
+		s += head;
+		len -= head;
+	}
+
+	size_t lines = len / CACHE_LINE_SIZE;
+	movnt_copy(d, s, lines);
+	d += lines * CACHE_LINE_SIZE;
+	s += lines * CACHE_LINE_SIZE;
+	len -= lines * CACHE_LINE_SIZE;
+
+	if (len != 0) {
+		memcpy(d, s, len);
+		flush_lines(d, len);
+	}
+
+	//orders both the streaming stores and the flushes of the head and tail
+	_mm_sfence();
+
+	stats->fences++;
+	stats->stall_cycles += nv_getticks() - start;
+	return dest;
+}
+
+void* nv_memset_persist(void* dest, int c, size_t len) {
+	if ((len < NV_MOVNT_THRESHOLD) || (nv_flush_mode == NV_FLUSH_SIMULATED)) {
+		memset(dest, c, len);
+		write_data_wait(dest, len);
+		return dest;
+	}
+
+	ULONG64 start = nv_getticks();
+	nv_site_stats_t* stats = &nv_stats()->sites[NV_SITE_USER];
+	stats->lines_flushed += lines_spanned(dest, len);
+
+	char* d = (char*)dest;
+
+	size_t head = (CACHE_LINE_SIZE - ((UINT_PTR)d & (CACHE_LINE_SIZE - 1))) & (CACHE_LINE_SIZE - 1);
+	if (head != 0) {
+		memset(d, c, head);
+		flush_lines(d, head);
+		d += head;
+		len -= head;
+	}
+
+	size_t lines = len / CACHE_LINE_SIZE;
+	movnt_set(d, c, lines);
+	d += lines * CACHE_LINE_SIZE;
+	len -= lines * CACHE_LINE_SIZE;
+
+	if (len != 0) {
+		memset(d, c, len);
+		flush_lines(d, len);
+	}
+
+	_mm_sfence();
+
+	stats->fences++;
+	stats->stall_cycles += nv_getticks() - start;
+	return dest;
+}